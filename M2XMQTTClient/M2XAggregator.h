@@ -0,0 +1,265 @@
+#ifndef M2XAGGREGATOR_H_
+#define M2XAGGREGATOR_H_
+
+#include "M2XMQTTClient.h"
+
+/* Longest stream name that can be aggregated */
+#ifndef M2X_AGGREGATE_NAME_SIZE
+#define M2X_AGGREGATE_NAME_SIZE 32
+#endif
+
+/* Windows kept, counting the open one, while their aggregates can't be
+ * delivered */
+#ifndef M2X_AGGREGATE_WINDOWS
+#define M2X_AGGREGATE_WINDOWS 4
+#endif
+
+/* Aggregates sent for each stream, combined with | */
+static const uint8_t M2X_AGGREGATE_MIN = 0x01;
+static const uint8_t M2X_AGGREGATE_MAX = 0x02;
+static const uint8_t M2X_AGGREGATE_MEAN = 0x04;
+static const uint8_t M2X_AGGREGATE_COUNT = 0x08;
+static const uint8_t M2X_AGGREGATE_ALL = 0x0F;
+
+static const char* const M2X_AGGREGATE_SUFFIXES[] = { "_min", "_max", "_mean", "_count" };
+/* Longest suffix plus the terminating NUL */
+#define M2X_AGGREGATE_SUFFIX_SIZE 7
+
+// Reduces high rate stream values to a few aggregates per time window.
+//
+// Values added for a stream only update its running minimum, maximum, sum
+// and count, so each sample costs a table lookup and a few comparisons no
+// matter how long the window is. Every +window_ms+ milliseconds, checked on
+// each add() and poll() call, the aggregates selected with +aggregates+ are
+// sent for all streams that got values during the window in a single
+// request, as streams named after the original stream with a "_min",
+// "_max", "_mean" or "_count" suffix. For instance values of "vibration"
+// are sent as "vibration_min", "vibration_max", etc.
+//
+// Once the time is known, from setTime() or flush(at), each window is
+// timestamped with the time it ended and sent with postDeviceUpdates.
+// Windows that can't be delivered are kept with their own timestamps, up
+// to M2X_AGGREGATE_WINDOWS including the open one, and go out together
+// with the next window. When no more can be kept, or while the time is
+// unknown, the open window absorbs the next one instead. Without a time,
+// aggregates are sent with postDeviceUpdate and timestamped by the server.
+//
+// All storage is static: up to +MAX_STREAMS+ streams, whose aggregate stream
+// names are built once when a stream is first seen. Nothing is allocated
+// per sample or per window.
+template <int MAX_STREAMS = 4>
+class M2XAggregator {
+public:
+  M2XAggregator(M2XMQTTClient* client,
+                const char* deviceId,
+                unsigned long window_ms,
+                uint8_t aggregates = M2X_AGGREGATE_ALL);
+
+  // Adds +value+ to the window of stream +streamName+. Returns E_OK if the
+  // window is still open, otherwise the status code of the request sending
+  // it. E_INVALID is returned if the stream name is longer than
+  // M2X_AGGREGATE_NAME_SIZE, E_BUFFER_TOO_SMALL if no stream slot is left.
+  int add(const char* streamName, double value);
+
+  // Sends the aggregates if the window has ended. Returns E_OK if nothing
+  // had to be sent, otherwise the status code of the request.
+  int poll();
+
+  // Ends the window now and sends its aggregates along with the windows
+  // kept from earlier attempts, returns the status code of the request.
+  // The second form also sets the time to +at+, see setTime(). If the
+  // request could not be delivered (E_NOCONNECTION or E_DISCONNECTED) the
+  // windows are kept for the next attempt.
+  int flush();
+  int flush(int64_t at);
+
+  // Sets the current time in milliseconds since the epoch, from which
+  // windows are timestamped from now on
+  void setTime(int64_t now);
+
+private:
+  struct Window {
+    double min;
+    double max;
+    double sum;
+    unsigned long count;
+  };
+
+  struct Entry {
+    char names[4][M2X_AGGREGATE_NAME_SIZE + M2X_AGGREGATE_SUFFIX_SIZE];
+    size_t name_length;
+    Window windows[M2X_AGGREGATE_WINDOWS];
+  };
+
+  M2XMQTTClient* _client;
+  const char* _deviceId;
+  unsigned long _window_ms;
+  uint8_t _aggregates;
+  M2XTimer _timer;
+  uint64_t _window_start;
+  bool _has_time;
+  int64_t _time_offset;
+
+  Entry _entries[MAX_STREAMS];
+  int _stream_num;
+  /* Windows before the open one are ended, waiting to be delivered */
+  int _open;
+  int64_t _ends[M2X_AGGREGATE_WINDOWS];
+
+  /* Views of the aggregates handed to postDeviceUpdates, grouped by
+   * aggregate stream */
+  const char* _names[MAX_STREAMS * 4];
+  int _counts[MAX_STREAMS * 4];
+  int64_t _ats[MAX_STREAMS * 4 * M2X_AGGREGATE_WINDOWS];
+  double _values[MAX_STREAMS * 4 * M2X_AGGREGATE_WINDOWS];
+
+  Entry* findStream(const char* streamName);
+  int send();
+};
+
+template <int MAX_STREAMS>
+M2XAggregator<MAX_STREAMS>::M2XAggregator(M2XMQTTClient* client,
+                                          const char* deviceId,
+                                          unsigned long window_ms,
+                                          uint8_t aggregates) :
+    _client(client),
+    _deviceId(deviceId),
+    _window_ms(window_ms),
+    _aggregates(aggregates & M2X_AGGREGATE_ALL),
+    _window_start(0),
+    _has_time(false),
+    _time_offset(0),
+    _stream_num(0),
+    _open(0) {
+  _timer.start();
+}
+
+template <int MAX_STREAMS>
+typename M2XAggregator<MAX_STREAMS>::Entry*
+M2XAggregator<MAX_STREAMS>::findStream(const char* streamName) {
+  size_t name_length;
+  Entry* entry;
+  int i;
+
+  for (i = 0; i < _stream_num; i++) {
+    /* The original name is the prefix of each aggregate name */
+    name_length = _entries[i].name_length;
+    if (strncmp(_entries[i].names[0], streamName, name_length) == 0 &&
+        streamName[name_length] == '\0') {
+      return &_entries[i];
+    }
+  }
+  name_length = strlen(streamName);
+  if (name_length > M2X_AGGREGATE_NAME_SIZE || _stream_num == MAX_STREAMS) {
+    return NULL;
+  }
+  entry = &_entries[_stream_num++];
+  entry->name_length = name_length;
+  for (i = 0; i < 4; i++) {
+    memcpy(entry->names[i], streamName, name_length);
+    strcpy(entry->names[i] + name_length, M2X_AGGREGATE_SUFFIXES[i]);
+  }
+  for (i = 0; i < M2X_AGGREGATE_WINDOWS; i++) { entry->windows[i].count = 0; }
+  return entry;
+}
+
+template <int MAX_STREAMS>
+int M2XAggregator<MAX_STREAMS>::add(const char* streamName, double value) {
+  Entry* entry = findStream(streamName);
+  Window* window;
+
+  if (entry == NULL) {
+    return strlen(streamName) > M2X_AGGREGATE_NAME_SIZE ? E_INVALID : E_BUFFER_TOO_SMALL;
+  }
+  window = &entry->windows[_open];
+  if (window->count == 0) {
+    window->min = window->max = window->sum = value;
+  } else {
+    if (value < window->min) { window->min = value; }
+    if (value > window->max) { window->max = value; }
+    window->sum += value;
+  }
+  window->count++;
+  return poll();
+}
+
+template <int MAX_STREAMS>
+int M2XAggregator<MAX_STREAMS>::poll() {
+  if (_timer.read_ms64() - _window_start >= _window_ms) {
+    return flush();
+  }
+  return E_OK;
+}
+
+template <int MAX_STREAMS>
+int M2XAggregator<MAX_STREAMS>::flush() {
+  return send();
+}
+
+template <int MAX_STREAMS>
+int M2XAggregator<MAX_STREAMS>::flush(int64_t at) {
+  setTime(at);
+  return send();
+}
+
+template <int MAX_STREAMS>
+void M2XAggregator<MAX_STREAMS>::setTime(int64_t now) {
+  _time_offset = now - (int64_t) _timer.read_ms64();
+  _has_time = true;
+}
+
+template <int MAX_STREAMS>
+int M2XAggregator<MAX_STREAMS>::send() {
+  int streamNum = 0, valueNum = 0, i, a, w, status;
+  uint64_t now = _timer.read_ms64();
+  Window* window;
+  Entry* entry;
+  double value;
+
+  _window_start = now;
+  _ends[_open] = _time_offset + (int64_t) now;
+  for (i = 0; i < _stream_num; i++) {
+    entry = &_entries[i];
+    for (a = 0; a < 4; a++) {
+      if (!(_aggregates & (1 << a))) { continue; }
+      _names[streamNum] = entry->names[a];
+      _counts[streamNum] = 0;
+      for (w = 0; w <= _open; w++) {
+        window = &entry->windows[w];
+        if (window->count == 0) { continue; }
+        switch (a) {
+          case 0: value = window->min; break;
+          case 1: value = window->max; break;
+          case 2: value = window->sum / window->count; break;
+          default: value = (double) window->count; break;
+        }
+        _ats[valueNum] = _ends[w];
+        _values[valueNum++] = value;
+        _counts[streamNum]++;
+      }
+      if (_counts[streamNum] > 0) { streamNum++; }
+    }
+  }
+  if (streamNum == 0) { return E_OK; }
+  /* Only timestamped windows are ever kept apart, see below */
+  if (_has_time) {
+    status = _client->postDeviceUpdates(_deviceId, streamNum, _names, _counts, _ats, _values);
+  } else {
+    status = _client->postDeviceUpdate(_deviceId, streamNum, _names, _values);
+  }
+  if (status == E_NOCONNECTION || status == E_DISCONNECTED) {
+    /* Keep the ended windows and open a new one if there is room left,
+     * otherwise the open window goes on and takes the next one's end */
+    if (_has_time && _open < M2X_AGGREGATE_WINDOWS - 1) {
+      _open++;
+    }
+    return status;
+  }
+  for (i = 0; i < _stream_num; i++) {
+    for (w = 0; w <= _open; w++) { _entries[i].windows[w].count = 0; }
+  }
+  _open = 0;
+  return status;
+}
+
+#endif  /* M2XAGGREGATOR_H_ */
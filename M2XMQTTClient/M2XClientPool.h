@@ -0,0 +1,511 @@
+#ifndef M2XCLIENTPOOL_H_
+#define M2XCLIENTPOOL_H_
+
+#ifndef LINUX_PLATFORM
+#error "M2XClientPool is only available on Linux!"
+#endif
+
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "M2XMQTTClient.h"
+#include "M2XRequestQueue.h"
+
+/* Values each connection of the pool can hold until its shard sends them */
+#ifndef M2X_POOL_QUEUE_SIZE
+#define M2X_POOL_QUEUE_SIZE 8
+#endif
+
+/* How often each shard polls all of its connections, for keepalive,
+ * reconnects and request timeouts */
+#ifndef M2X_POOL_TICK_MS
+#define M2X_POOL_TICK_MS 1000
+#endif
+
+// Called from a worker thread when the response to a request sent for
+// +connection+, the index returned by M2XClientPool::add(), arrives
+typedef void (* M2XPoolResponseCallback)(int connection, int16_t id, int status,
+                                         void* context);
+
+// Counters of one shard. They are updated by its worker thread and read
+// without locking, so a snapshot may be slightly behind.
+struct M2XPoolStats {
+  unsigned long connections;
+  unsigned long connected;
+  // Requests written to the server
+  unsigned long submitted;
+  // Responses with a 2xx status
+  unsigned long succeeded;
+  // Responses with an error status, or requests lost with the connection
+  unsigned long failed;
+  // Values rejected because the queue of their connection was full
+  unsigned long dropped;
+};
+
+// Many M2X connections, each with its own API key, sharded across worker
+// threads.
+//
+// A gateway proxying many devices can run one pool instead of one process
+// per key. Connections are registered with add() before start(), which
+// spawns +shards+ worker threads, typically one per core. Each connection
+// belongs to one shard, whose thread owns its socket and drives all of its
+// connections from a single M2XEventLoop.
+//
+// Any thread can submit values with updateStreamValue(), routed to the
+// connection by its index or its API key. Values are pushed into the
+// lock-free M2XRequestQueue of the connection, which is marked dirty, and
+// its shard is woken up through an eventfd, so submitting never waits for
+// the network. On a wakeup the shard only services its dirty connections
+// and those with data to read, all of them are looked at every
+// M2X_POOL_TICK_MS.
+//
+// Connections use non-blocking sockets with fast connect. Only establishing
+// the TCP connection still waits, up to M2X_LINUX_SOCKET_TIMEOUT_MS.
+//
+// NOTE: keys are not copied, the strings passed to add() must stay valid
+// for the lifetime of the pool.
+class M2XClientPool {
+public:
+  M2XClientPool(int shards,
+                const char* host = DEFAULT_M2X_HOST,
+                int port = DEFAULT_M2X_PORT);
+  ~M2XClientPool();
+
+  // Registers a connection using +key+ and returns its index, or -1 if the
+  // pool is already running
+  int add(const char* key);
+
+  // Index of the connection using +key+, or -1
+  int find(const char* key) const;
+
+  // Starts the worker threads. Returns E_OK, or E_INVALID if the pool is
+  // already running or its shards or threads couldn't be set up.
+  int start();
+
+  // Stops the worker threads and closes all connections
+  void stop();
+
+  // Queues +value+ for stream +streamName+ of +deviceId+ on a connection.
+  // Safe to call from any thread once the pool is running. Returns E_OK,
+  // E_INVALID if there is no such connection or the stream name is too
+  // long, or E_BUFFER_TOO_SMALL if the queue of the connection is full.
+  int updateStreamValue(int connection, const char* deviceId,
+                        const char* streamName, double value);
+  int updateStreamValue(const char* key, const char* deviceId,
+                        const char* streamName, double value);
+
+  // Same, with the time the value was taken in milliseconds since the epoch
+  int updateStreamValue(int connection, const char* deviceId,
+                        const char* streamName, double value, int64_t at);
+  int updateStreamValue(const char* key, const char* deviceId,
+                        const char* streamName, double value, int64_t at);
+
+  void setResponseCallback(M2XPoolResponseCallback callback, void* context = NULL);
+
+  int shards() const { return _shard_count; }
+  int connections() const { return _connection_count; }
+  M2XPoolStats stats(int shard) const;
+
+private:
+  struct Shard;
+
+  struct Connection {
+    Connection(const char* key, const char* host, int port);
+
+    TCPClient<> tcp;
+    M2XMQTTClient client;
+    M2XRequestQueue<M2X_POOL_QUEUE_SIZE> queue;
+    const char* key;
+    M2XClientPool* pool;
+    Shard* shard;
+    int index;
+    int fd;
+    bool connected;
+    // Set by submit() while the connection is on the dirty list of its shard
+    volatile uint32_t dirty;
+    Connection* next_dirty;
+  };
+
+  struct Shard {
+    M2XClientPool* pool;
+    pthread_t thread;
+    bool started;
+    int wakeup_fd;
+    M2XEventLoop loop;
+    Connection** connections;
+    int count;
+    // Lock-free stack of connections with newly queued values
+    Connection* volatile dirty;
+    volatile unsigned long connected;
+    volatile unsigned long submitted;
+    volatile unsigned long succeeded;
+    volatile unsigned long failed;
+  };
+
+  const char* _host;
+  int _port;
+  int _shard_count;
+  Shard* _shards;
+  Connection** _connections;
+  int _connection_count;
+  int _connection_capacity;
+  int* _table;
+  uint32_t _table_mask;
+  volatile bool _running;
+  M2XPoolResponseCallback _response_callback;
+  void* _response_context;
+
+  int submit(int connection, const char* deviceId, const char* streamName,
+             bool timestamped, int64_t at, double value);
+  void service(Connection* connection);
+  void serviceDirty(Shard* shard);
+  void run(Shard* shard);
+  static void* runShard(void* shard);
+  static void onResponse(int16_t id, int status, void* context);
+};
+
+// FNV-1a hash of a NUL terminated key
+static inline uint32_t m2x_hash_key(const char* key) {
+  uint32_t hash = 2166136261u;
+  while (*key) {
+    hash = (hash ^ (uint8_t) *key++) * 16777619u;
+  }
+  return hash;
+}
+
+M2XClientPool::Connection::Connection(const char* key, const char* host, int port) :
+    tcp(0),
+    client(&tcp, key, NULL, true, host, port),
+    queue(),
+    key(key),
+    pool(NULL),
+    shard(NULL),
+    index(0),
+    fd(-1),
+    connected(false),
+    dirty(0),
+    next_dirty(NULL) {
+  client.setFastConnect(true);
+  client.setNonBlockingRequests(true);
+}
+
+M2XClientPool::M2XClientPool(int shards, const char* host, int port) : _host(host),
+                                                                       _port(port),
+                                                                       _shard_count(shards > 0 ? shards : 1),
+                                                                       _shards(NULL),
+                                                                       _connections(NULL),
+                                                                       _connection_count(0),
+                                                                       _connection_capacity(0),
+                                                                       _table(NULL),
+                                                                       _table_mask(0),
+                                                                       _running(false),
+                                                                       _response_callback(NULL),
+                                                                       _response_context(NULL) {
+}
+
+M2XClientPool::~M2XClientPool() {
+  stop();
+  for (int i = 0; i < _connection_count; i++) { delete _connections[i]; }
+  free(_connections);
+  free(_table);
+}
+
+int M2XClientPool::add(const char* key) {
+  Connection** connections;
+
+  if (_running) { return -1; }
+  if (_connection_count == _connection_capacity) {
+    _connection_capacity = _connection_capacity ? _connection_capacity * 2 : 16;
+    connections = (Connection**) realloc(_connections,
+                                         _connection_capacity * sizeof(Connection*));
+    if (connections == NULL) { return -1; }
+    _connections = connections;
+  }
+  _connections[_connection_count] = new Connection(key, _host, _port);
+  _connections[_connection_count]->pool = this;
+  _connections[_connection_count]->index = _connection_count;
+  return _connection_count++;
+}
+
+int M2XClientPool::find(const char* key) const {
+  uint32_t slot;
+
+  if (_table == NULL) { return -1; }
+  /* Linear probing, the table is at most half full */
+  for (slot = m2x_hash_key(key) & _table_mask; _table[slot] != -1;
+       slot = (slot + 1) & _table_mask) {
+    if (strcmp(_connections[_table[slot]]->key, key) == 0) {
+      return _table[slot];
+    }
+  }
+  return -1;
+}
+
+int M2XClientPool::start() {
+  uint32_t size = 2, slot;
+  int i, s;
+
+  if (_running) { return E_INVALID; }
+
+  /* The key lookup table never changes while running, so it can be read
+   * from any thread without locking */
+  while (size < 2 * (uint32_t) _connection_count) { size *= 2; }
+  free(_table);
+  _table = (int*) malloc(size * sizeof(int));
+  if (_table == NULL) { return E_INVALID; }
+  _table_mask = size - 1;
+  for (slot = 0; slot < size; slot++) { _table[slot] = -1; }
+  for (i = 0; i < _connection_count; i++) {
+    slot = m2x_hash_key(_connections[i]->key) & _table_mask;
+    while (_table[slot] != -1) { slot = (slot + 1) & _table_mask; }
+    _table[slot] = i;
+  }
+
+  /* Every shard is safe to tear down by stop() before any can fail */
+  _shards = new Shard[_shard_count];
+  for (s = 0; s < _shard_count; s++) {
+    Shard* shard = &_shards[s];
+    shard->pool = this;
+    shard->count = 0;
+    shard->started = false;
+    shard->connected = shard->submitted = shard->succeeded = shard->failed = 0;
+    shard->connections = NULL;
+    shard->dirty = NULL;
+    shard->wakeup_fd = -1;
+  }
+  for (s = 0; s < _shard_count; s++) {
+    Shard* shard = &_shards[s];
+    shard->connections = (Connection**) malloc(
+        ((_connection_count + _shard_count - 1) / _shard_count + 1) * sizeof(Connection*));
+    shard->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (shard->connections == NULL || shard->wakeup_fd == -1 ||
+        shard->loop.add(shard->wakeup_fd, shard) != 0) {
+      DBGLN("%s", F("Error setting up pool shard!"));
+      stop();
+      return E_INVALID;
+    }
+  }
+
+  /* Connections are dealt to the shards round robin */
+  for (i = 0; i < _connection_count; i++) {
+    Shard* shard = &_shards[i % _shard_count];
+    _connections[i]->shard = shard;
+    _connections[i]->dirty = 0;
+    _connections[i]->client.setResponseCallback(onResponse, _connections[i]);
+    shard->connections[shard->count++] = _connections[i];
+  }
+
+  _running = true;
+  for (s = 0; s < _shard_count; s++) {
+    if (pthread_create(&_shards[s].thread, NULL, runShard, &_shards[s]) != 0) {
+      DBGLN("%s", F("Error starting pool worker thread!"));
+      stop();
+      return E_INVALID;
+    }
+    _shards[s].started = true;
+  }
+  return E_OK;
+}
+
+void M2XClientPool::stop() {
+  uint64_t one = 1;
+  int s, i;
+
+  if (_shards == NULL) { return; }
+  _running = false;
+  for (s = 0; s < _shard_count; s++) {
+    if (!_shards[s].started) { continue; }
+    if (::write(_shards[s].wakeup_fd, &one, sizeof(one)) < 0) {
+      DBGLN("%s", F("Error waking up pool worker thread!"));
+    }
+  }
+  for (s = 0; s < _shard_count; s++) {
+    if (_shards[s].started) { pthread_join(_shards[s].thread, NULL); }
+    for (i = 0; i < _shards[s].count; i++) {
+      _shards[s].connections[i]->tcp.stop();
+      _shards[s].connections[i]->fd = -1;
+      _shards[s].connections[i]->connected = false;
+    }
+    if (_shards[s].wakeup_fd != -1) { ::close(_shards[s].wakeup_fd); }
+    free(_shards[s].connections);
+  }
+  delete[] _shards;
+  _shards = NULL;
+}
+
+int M2XClientPool::updateStreamValue(int connection, const char* deviceId,
+                                     const char* streamName, double value) {
+  return submit(connection, deviceId, streamName, false, 0, value);
+}
+
+int M2XClientPool::updateStreamValue(const char* key, const char* deviceId,
+                                     const char* streamName, double value) {
+  return submit(find(key), deviceId, streamName, false, 0, value);
+}
+
+int M2XClientPool::updateStreamValue(int connection, const char* deviceId,
+                                     const char* streamName, double value, int64_t at) {
+  return submit(connection, deviceId, streamName, true, at, value);
+}
+
+int M2XClientPool::updateStreamValue(const char* key, const char* deviceId,
+                                     const char* streamName, double value, int64_t at) {
+  return submit(find(key), deviceId, streamName, true, at, value);
+}
+
+int M2XClientPool::submit(int connection, const char* deviceId, const char* streamName,
+                          bool timestamped, int64_t at, double value) {
+  uint64_t one = 1;
+  Connection* c;
+  Shard* shard;
+  int status;
+
+  if (!_running || connection < 0 || connection >= _connection_count) { return E_INVALID; }
+  c = _connections[connection];
+  status = timestamped ? c->queue.push(deviceId, streamName, value, at) :
+      c->queue.push(deviceId, streamName, value);
+  /* Only the submission that marks the connection dirty pushes it and
+   * wakes up the shard, later ones find it still waiting */
+  if (status != E_OK || !m2x_atomic_cas(&c->dirty, 0, 1)) { return status; }
+  shard = c->shard;
+  do {
+    c->next_dirty = shard->dirty;
+  } while (!__sync_bool_compare_and_swap(&shard->dirty, c->next_dirty, c));
+  if (::write(shard->wakeup_fd, &one, sizeof(one)) < 0) {
+    DBGLN("%s", F("Error waking up pool worker thread!"));
+  }
+  return status;
+}
+
+void M2XClientPool::setResponseCallback(M2XPoolResponseCallback callback, void* context) {
+  _response_callback = callback;
+  _response_context = context;
+}
+
+M2XPoolStats M2XClientPool::stats(int shard) const {
+  M2XPoolStats stats;
+  int i;
+
+  memset(&stats, 0, sizeof(stats));
+  if (_shards == NULL || shard < 0 || shard >= _shard_count) { return stats; }
+  stats.connections = _shards[shard].count;
+  stats.connected = _shards[shard].connected;
+  stats.submitted = _shards[shard].submitted;
+  stats.succeeded = _shards[shard].succeeded;
+  stats.failed = _shards[shard].failed;
+  for (i = 0; i < _shards[shard].count; i++) {
+    stats.dropped += _shards[shard].connections[i]->queue.dropped();
+  }
+  return stats;
+}
+
+void M2XClientPool::onResponse(int16_t id, int status, void* context) {
+  Connection* c = (Connection*) context;
+
+  if (m2x_status_is_success(status)) {
+    c->shard->succeeded++;
+  } else {
+    c->shard->failed++;
+  }
+  if (c->pool->_response_callback) {
+    c->pool->_response_callback(c->index, id, status, c->pool->_response_context);
+  }
+}
+
+// Reads what arrived on a connection, keeps it alive and sends as many
+// queued values as it has free request slots for. Only the worker thread
+// of its shard calls this.
+void M2XClientPool::service(Connection* c) {
+  int count;
+
+  c->client.poll();
+  if (c->client.connected()) {
+    /* The client uses non-blocking requests, so draining stops at the
+     * first value without a free request slot instead of holding up the
+     * shard */
+    count = c->queue.drain(&c->client);
+    if (count > 0) {
+      c->shard->submitted += count;
+      c->tcp.flush();
+    }
+  }
+  /* Closing the socket took it out of the event loop, and the next socket
+   * may well get the same number */
+  if (!c->client.connected()) { c->fd = -1; }
+  if (c->client.connected() != c->connected) {
+    c->connected = c->client.connected();
+    if (c->connected) {
+      c->shard->connected++;
+    } else {
+      c->shard->connected--;
+    }
+  }
+  if (c->connected && c->tcp.fd() != c->fd) {
+    c->fd = c->tcp.fd();
+    c->shard->loop.add(c->fd, c);
+  }
+}
+
+// Services the connections submit() marked dirty since the last call
+void M2XClientPool::serviceDirty(Shard* shard) {
+  Connection* c = __sync_lock_test_and_set(&shard->dirty, (Connection*) NULL);
+  Connection* next;
+
+  while (c != NULL) {
+    /* Once the flag is cleared submit() may push the connection again,
+     * so its link has to be read first */
+    next = c->next_dirty;
+    m2x_memory_barrier();
+    c->dirty = 0;
+    m2x_memory_barrier();
+    service(c);
+    c = next;
+  }
+}
+
+void M2XClientPool::run(Shard* shard) {
+  void* ready[64];
+  uint64_t value;
+  uint64_t last_tick;
+  bool woken;
+  int count, i;
+  M2XTimer timer;
+
+  timer.start();
+  for (i = 0; i < shard->count; i++) { service(shard->connections[i]); }
+  last_tick = timer.read_ms64();
+  while (_running) {
+    count = shard->loop.wait(ready, 64, M2X_POOL_TICK_MS);
+    woken = false;
+    for (i = 0; i < count; i++) {
+      if (ready[i] == shard) {
+        woken = true;
+      } else {
+        service((Connection*) ready[i]);
+      }
+    }
+    if (woken) {
+      if (::read(shard->wakeup_fd, &value, sizeof(value)) < 0) {
+        DBGLN("%s", F("Error reading pool wakeup counter!"));
+      }
+    }
+    if (!_running) { break; }
+    /* Connections stay on the dirty list until it is taken, or submit()
+     * would never wake up the shard for them again */
+    if (woken) { serviceDirty(shard); }
+    /* Every connection needs a look now and then for keepalive, reconnects
+     * and request timeouts. Values left queued for lack of a request slot
+     * are sent as soon as a response frees one, or on the next tick. */
+    if (timer.read_ms64() - last_tick >= M2X_POOL_TICK_MS) {
+      for (i = 0; i < shard->count; i++) { service(shard->connections[i]); }
+      last_tick = timer.read_ms64();
+    }
+  }
+}
+
+void* M2XClientPool::runShard(void* shard) {
+  ((Shard*) shard)->pool->run((Shard*) shard);
+  return NULL;
+}
+
+#endif  /* M2XCLIENTPOOL_H_ */
@@ -25,10 +25,17 @@
 #define MIN(a, b) (((a) > (b))?(b):(a))
 #define TO_HEX(t_) ((char) (((t_) > 9) ? ((t_) - 10 + 'A') : ((t_) + '0')))
 #define MAX_DOUBLE_DIGITS 7
+/* Prints a string literal or char array without measuring it at runtime */
+#define M2X_PRINT_LITERAL(print_, str_) \
+  (print_)->write((const uint8_t *) (str_), sizeof(str_) - 1)
+
+#include "m2x-config.h"
 
 /* For tolower */
 #include <ctype.h>
 
+#include "m2x-parser.h"
+
 static const int E_OK = 0;
 static const int E_NOCONNECTION = -1;
 static const int E_DISCONNECTED = -2;
@@ -37,10 +44,43 @@ static const int E_INVALID = -4;
 static const int E_JSON_INVALID = -5;
 static const int E_BUFFER_TOO_SMALL = -6;
 static const int E_TIMESTAMP_ERROR = -8;
+static const int E_NOT_READY = -9;
+static const int E_TIMEOUT = -10;
+
+#include "m2x-batch.h"
+#include "m2x-stats.h"
+#include "m2x-time.h"
+
+/* Packet identifier of the SUBSCRIBE packet, request IDs never reach it */
+static const uint16_t M2X_SUBSCRIBE_PACKET_ID = 0x8000;
+
+/* Handshake steps still awaited while connecting */
+static const uint8_t M2X_AWAIT_CONNACK = 0x01;
+static const uint8_t M2X_AWAIT_SUBACK = 0x02;
 
 static const char* DEFAULT_M2X_HOST = "api-m2x.att.com";
 static const int DEFAULT_M2X_PORT = 1883;
 
+/* Fixed fragments of the JSON request envelope */
+static const char M2X_REQUEST_ID[] = "{\"id\":\"";
+static const char M2X_METHOD_PUT[] = "\",\"method\":\"PUT\",\"resource\":\"";
+static const char M2X_METHOD_POST[] = "\",\"method\":\"POST\",\"resource\":\"";
+static const char M2X_METHOD_DELETE[] = "\",\"method\":\"DELETE\",\"resource\":\"";
+static const char M2X_DEVICES_PATH[] = "/v2/devices/";
+static const char M2X_REQUEST_AGENT[] = "\",\"agent\":\"" USER_AGENT "\",\"body\":";
+
+// Prints a timestamp given either as ISO 8601 text or in milliseconds since
+// the epoch. Text is printed as is, so it needs no formatter.
+static inline size_t m2x_print_timestamp(Print* print, const char* at,
+                                         M2XTimestampFormatter*) {
+  return print->print(at);
+}
+
+static inline size_t m2x_print_timestamp(Print* print, int64_t at,
+                                         M2XTimestampFormatter* formatter) {
+  return print->write((const uint8_t *) formatter->format(at), M2X_ISO8601_LENGTH);
+}
+
 static inline bool m2x_status_is_success(int status) {
   return (status == E_OK) || (status >= 200 && status <= 299);
 }
@@ -74,11 +114,65 @@ public:
   }
 };
 
+// Bounded Print used to stage a payload in RAM before sending it. Bytes
+// beyond the buffer capacity are dropped but still counted, so +length+
+// is always the full length printed. The first +reserved+ bytes are kept
+// across reset(), which lets a fixed prefix be rendered only once. The
+// precision of the first M2X_FORMAT_CACHE_SIZE floating point values is
+// kept for rendering them again if the payload doesn't fit.
+class BufferPrint : public Print {
+public:
+  uint8_t buffer[M2X_PAYLOAD_BUFFER_SIZE];
+  size_t length;
+  size_t reserved;
+  uint8_t precisions[M2X_FORMAT_CACHE_SIZE];
+  size_t precision_count;
+
+  void reserve() {
+    reserved = length;
+  }
+
+  void reset() {
+    length = reserved;
+    precision_count = 0;
+  }
+
+  bool overflowed() const {
+    return length > sizeof(buffer);
+  }
+
+  virtual size_t write(uint8_t b) {
+    return write(&b, 1);
+  }
+
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    if (length + size <= sizeof(buffer)) {
+      memcpy(buffer + length, buf, size);
+    }
+    length += size;
+    return size;
+  }
+
+protected:
+  virtual size_t formatDouble(char* buf, double n, int digits, bool single) {
+    int precision = 0;
+    size_t size = m2x_format_double(buf, n, digits, single, &precision);
+    if (precision_count < M2X_FORMAT_CACHE_SIZE) {
+      precisions[precision_count++] = (uint8_t) precision;
+    }
+    return size;
+  }
+};
+
 // Handy helper class for printing MQTT payload using a Print
 class MMQTTPrint : public Print {
 public:
   mmqtt_connection *connection;
   mmqtt_s_puller puller;
+  // Payload measured before being printed here, whose floating point
+  // values are printed again in the same order
+  const BufferPrint* measured;
+  size_t measured_next;
 
   virtual size_t write(uint8_t b) {
     return write(&b, 1);
@@ -87,10 +181,69 @@ public:
   virtual size_t write(const uint8_t* buf, size_t size) {
     return mmqtt_s_encode_buffer(connection, puller, buf, size) == MMQTT_STATUS_OK ? size : -1;
   }
+
+protected:
+  virtual size_t formatDouble(char* buf, double n, int digits, bool single) {
+    int precision = 0;
+    if (measured && measured_next < measured->precision_count) {
+      precision = measured->precisions[measured_next++];
+    }
+    return m2x_format_double(buf, n, digits, single, &precision);
+  }
+};
+
+// Called when the response to a request submitted using one of the *Async
+// functions arrives. +id+ is the value returned at submission time, +status+
+// is the HTTP status code or one of the error codes above.
+typedef void (* M2XResponseCallback)(int16_t id, int status, void* context);
+
+// A message pushed by the server, such as a device command
+struct M2XMessage {
+  // Last segment of the topic it was published to, e.g. "commands"
+  const char* type;
+  // The payload, NUL terminated, and its length. When it didn't fit in
+  // M2X_MESSAGE_BUFFER_SIZE only the beginning is kept and +truncated+ is
+  // set.
+  const char* payload;
+  size_t length;
+  bool truncated;
+};
+
+// Called from poll(), or while waiting for a response, for each message
+// of the type the handler was registered for. The message is only valid
+// until the handler returns.
+typedef void (* M2XMessageHandler)(const M2XMessage* message, void* context);
+
+// A registered message handler, a NULL +type+ matches any message no other
+// handler takes
+struct M2XMessageHandlerEntry {
+  const char* type;
+  M2XMessageHandler handler;
+  void* context;
+};
+
+// A request waiting for its response
+struct M2XPendingRequest {
+  int16_t id;
+  int16_t status;
+  bool notify;
+  bool done;
+  uint64_t sent_ms;
+};
+
+// A QoS 1 PUBLISH waiting for its PUBACK, the packet identifier is the
+// request ID. A packet identifier of 0 marks a free slot.
+struct M2XUnackedPublish {
+  uint16_t packet_id;
+  uint16_t length;
+  uint8_t payload[M2X_PAYLOAD_BUFFER_SIZE];
 };
 
 class M2XMQTTClient {
 public:
+  // +idlefunc+ is called while waiting for data from the server. With
+  // +keepalive+ set, the connection is kept alive with PINGREQ packets and
+  // poll() reconnects when the connection is lost.
   M2XMQTTClient(Client* client,
                 const char* key,
                 void (* idlefunc)(void) = NULL,
@@ -130,6 +283,17 @@ public:
                         const char* names[], const int counts[],
                         const char* ats[], T values[]);
 
+  // Same, with timestamps given in milliseconds since the epoch. They are
+  // rendered as ISO 8601 text while the request is sent.
+  template <class T>
+  int postDeviceUpdates(const char* deviceId, int streamNum,
+                        const char* names[], const int counts[],
+                        const int64_t ats[], T values[]);
+
+  // Post all values of +batch+ to M2X at once, see m2x-batch.h. Streams
+  // without values are left out.
+  int postDeviceUpdates(const char* deviceId, const M2XBatch& batch);
+
   // Post multiple values of a single device at once.
   // +deviceId+ - id of the device to post values
   // +streamNum+ - Number of streams to post
@@ -146,6 +310,12 @@ public:
                        const char* names[], T values[],
                        const char* at = NULL);
 
+  // Same, with the timestamp +at+ given in milliseconds since the epoch.
+  // This has its own name, as an overload would make a NULL +at+ ambiguous.
+  template <class T>
+  int postDeviceUpdateMs(const char* deviceId, int streamNum,
+                         const char* names[], T values[], int64_t at);
+
   // Update datasource location
   // NOTE: On an Arduino Uno and other ATMEGA based boards, double has
   // 4-byte (32 bits) precision, which is the same as float. So there's
@@ -183,8 +353,133 @@ public:
   int deleteValues(const char* deviceId, const char* streamName,
                    const char* from, const char* end);
 
+  // Sends the statistics of the client, printed as by printStats(), as the
+  // value of stream +streamName+. Call it periodically to keep an eye on
+  // devices in the field.
+  int postStats(const char* deviceId, const char* streamName);
+
+  // Asynchronous versions of the API functions above. Instead of waiting
+  // for the response, these return as soon as the request is sent, so up to
+  // M2X_MAX_PENDING_REQUESTS requests can be in flight at once. The returned
+  // value is a positive request ID, or a negative error code if the request
+  // could not be sent. The status code of each request is delivered to the
+  // callback set via setResponseCallback() from within poll() or any other
+  // call that reads from the connection.
+  template <class T>
+  int updateStreamValueAsync(const char* deviceId, const char* streamName, T value);
+
+  template <class T>
+  int postDeviceUpdatesAsync(const char* deviceId, int streamNum,
+                             const char* names[], const int counts[],
+                             const char* ats[], T values[]);
+
+  template <class T>
+  int postDeviceUpdatesAsync(const char* deviceId, int streamNum,
+                             const char* names[], const int counts[],
+                             const int64_t ats[], T values[]);
+
+  int postDeviceUpdatesAsync(const char* deviceId, const M2XBatch& batch);
+
+  template <class T>
+  int postDeviceUpdateAsync(const char* deviceId, int streamNum,
+                            const char* names[], T values[],
+                            const char* at = NULL);
+
+  template <class T>
+  int postDeviceUpdateMsAsync(const char* deviceId, int streamNum,
+                              const char* names[], T values[], int64_t at);
+
+  template <class T>
+  int updateLocationAsync(const char* deviceId, const char* name,
+                          T latitude, T longitude, T elevation);
+
+  int deleteValuesAsync(const char* deviceId, const char* streamName,
+                        const char* from, const char* end);
+
+  int postStatsAsync(const char* deviceId, const char* streamName);
+
+  void setResponseCallback(M2XResponseCallback callback, void* context = NULL);
+
+  // Registers +handler+ for the messages the server pushes on the topic
+  // m2x/<API key>/<+type+>, e.g. "commands" for device command
+  // notifications. Registering "responses" delivers responses that match
+  // no pending request, and a NULL +type+ catches every message no other
+  // handler takes. Handlers of other types add their topic to the
+  // subscription made on the next connection. A NULL +handler+ removes
+  // the handler of +type+. The type string is not copied. Returns E_OK,
+  // E_INVALID if +type+ is longer than M2X_MESSAGE_TYPE_SIZE, or
+  // E_BUFFER_TOO_SMALL if M2X_MAX_MESSAGE_HANDLERS are already registered.
+  int setMessageHandler(const char* type, M2XMessageHandler handler,
+                        void* context = NULL);
+
+  // Reads all responses that have already arrived and delivers them to the
+  // response callback. This never waits for data, as long as the Client
+  // implements availableNow(): a partially received response is kept and
+  // completed on a later call. Returns the number of
+  // responses delivered, or E_DISCONNECTED if the connection was lost, in
+  // which case all pending requests are completed with E_DISCONNECTED.
+  // Requests waiting longer than M2X_REQUEST_TIMEOUT_MS are completed with
+  // E_TIMEOUT, these are not counted in the return value. With keepalive enabled, this also sends PINGREQ packets when needed
+  // and connects to the server when not connected, backing off
+  // exponentially while attempts fail. E_NOCONNECTION is returned while no
+  // connection could be made.
+  int poll();
+
+  bool connected() const { return _connected; }
+
+  // Number of submitted requests still waiting for a response
+  int pendingRequests() const;
+
+  // Sets the QoS level (0 or 1) requests are published with, the default
+  // is 0. With QoS 1 the server acknowledges each request with a PUBACK
+  // as soon as it is received. Requests that are not acknowledged when the
+  // connection drops are kept and sent again, flagged as duplicates, once
+  // the client reconnects, instead of failing with E_DISCONNECTED. Only
+  // payloads that fit in M2X_PAYLOAD_BUFFER_SIZE can be kept, and only if
+  // M2X_MAX_UNACKED_PUBLISHES reserves room for them.
+  void setPublishQoS(uint8_t qos);
+
+  // Number of QoS 1 requests not acknowledged by the server yet
+  int unackedPublishes() const;
+
+  // With fast connect enabled, CONNECT and SUBSCRIBE are written back to
+  // back, together with the first request if one triggered the connection,
+  // and CONNACK and SUBACK are checked as they arrive instead of waiting
+  // for each of them in turn. This saves two round trips per connection.
+  // If the server refuses the connection, requests sent meanwhile fail
+  // with E_DISCONNECTED (QoS 1 requests are kept and sent again).
+  void setFastConnect(bool enabled) { _fast_connect = enabled; }
+
+  // With non-blocking requests enabled, a request whose pending table slot
+  // is still taken by an older request, or that finds all QoS 1 resend
+  // slots in use, fails right away with E_NOT_READY instead of reading
+  // responses until the slot is free. Responses that have already arrived
+  // are read first. Useful when one thread drives many clients.
+  void setNonBlockingRequests(bool enabled) { _nonblocking_requests = enabled; }
+
+  // Asks the server to keep the session when the connection drops, using
+  // MQTT 3.1.1. The subscription to the responses topic then survives
+  // reconnects, so SUBSCRIBE is skipped when the server still has the
+  // session, and responses published while the client was offline are
+  // delivered once it is back. The session is found again by +client_id+,
+  // which has to be unique to this device and stay the same across
+  // restarts, the API key is used when it is NULL. With fast connect,
+  // SUBSCRIBE is still sent since it costs no round trip there. Takes
+  // effect on the next connection.
+  void setPersistentSession(bool enabled, const char* client_id = NULL) {
+    _persistent_session = enabled;
+    _client_id = client_id;
+  }
+
+  // Counters and latency histograms of the client, see m2x-stats.h
+  const M2XStats& stats() const { return _stats; }
+  void resetStats() { memset(&_stats, 0, sizeof(_stats)); }
+  // Prints the statistics as compact JSON
+  size_t printStats(Print* print) const { return m2x_print_stats(print, &_stats); }
+
   // Following fields are public so mmqtt callback functions can access directly
   Client* _client;
+  M2XStats _stats;
 private:
   struct mmqtt_connection _connection;
   const char* _key;
@@ -195,21 +490,82 @@ private:
   int _port;
   void (* _idlefunc)(void);
   const char* _path_prefix;
-  NullPrint _null_print;
+  size_t _path_prefix_length;
+  BufferPrint _payload_print;
   MMQTTPrint _mmqtt_print;
   int16_t _current_id;
+  M2XPendingRequest _pending[M2X_MAX_PENDING_REQUESTS];
+  M2XResponseCallback _response_callback;
+  void* _response_context;
+  M2XMessageHandlerEntry _handlers[M2X_MAX_MESSAGE_HANDLERS];
+  uint8_t _handler_count;
+  char _message[M2X_MESSAGE_BUFFER_SIZE];
+  M2XPacketParser _parser;
+  uint8_t _publish_qos;
+#if M2X_MAX_UNACKED_PUBLISHES > 0
+  M2XUnackedPublish _unacked[M2X_MAX_UNACKED_PUBLISHES];
+  uint8_t _unacked_head;
+  uint8_t _unacked_count;
+#endif  /* M2X_MAX_UNACKED_PUBLISHES > 0 */
+  M2XTimer _timer;
+  uint64_t _last_send_ms;
+  uint64_t _ping_sent_ms;
+  uint64_t _next_connect_ms;
+  uint64_t _connect_start_ms;
+  uint8_t _connect_attempts;
+  bool _ping_pending;
+  bool _fast_connect;
+  bool _nonblocking_requests;
+  bool _persistent_session;
+  const char* _client_id;
+  uint8_t _handshake;
 
   int connectToServer();
+  int awaitHandshake(uint8_t mask);
+  void handleHandshake();
+  void encodeSubscription(const char* type, size_t type_length);
+  int ensureConnected();
+  void scheduleReconnect();
+  bool keepAlive();
+  int beginRequest();
+  int waitForResponse(int id);
+  bool completeRequest(int16_t id, int status);
+  void failPendingRequests(int status);
+  bool expireRequests();
+
+  // Whether the type of +entry+ needs a topic of its own
+  static bool subscribesTo(const M2XMessageHandlerEntry* entry) {
+    return entry->type != NULL && strcmp(entry->type, "responses") != 0;
+  }
+
+  bool dispatchMessage();
+  bool sendStagedPublish();
+  void sendRequestTopic();
+  void resendUnackedPublishes();
+  void keepUnacked(const uint8_t* payload, size_t length);
+  void ackPublish(uint16_t packet_id);
+  void sendPuback(uint16_t packet_id);
+  bool isUnacked(int16_t id) const;
+  bool unackedFull() const;
+  int printRequestStart(Print* print, const char* method, size_t method_length);
 
   template <class T>
   int printUpdateStreamValuePayload(Print* print, const char* deviceId,
                                     const char* streamName, T value);
 
-  template <class T>
+  template <class T, class A>
+  int sendPostDeviceUpdates(const char* deviceId, int streamNum,
+                            const char* names[], const int counts[],
+                            A ats[], T values[]);
+
+  template <class T, class A>
   int printPostDeviceUpdatesPayload(Print* print,
                                     const char* deviceId, int streamNum,
                                     const char* names[], const int counts[],
-                                    const char* ats[], T values[]);
+                                    A ats[], T values[]);
+
+  int printPostDeviceUpdatesPayload(Print* print, const char* deviceId,
+                                    const M2XBatch& batch);
 
   template <class T>
   int printPostDeviceUpdatePayload(Print* print,
@@ -226,10 +582,23 @@ private:
                                const char* deviceId, const char* streamName,
                                const char* from, const char* end);
 
-  int readStatusCode();
+  int printStatsPayload(Print* print, const char* deviceId,
+                        const char* streamName, const M2XStats* stats);
+
+  int readPacket(bool wait);
+  bool handlePacket();
   void close();
 };
 
+// RAM taken by a client and its default TCPClient, fixed at compile time
+// since nothing is allocated on the heap
+static const size_t M2X_CLIENT_RAM_SIZE = sizeof(M2XMQTTClient) + sizeof(TCPClient<>);
+
+#ifdef M2X_RAM_BUDGET
+/* Fails to compile when the configuration doesn't fit in M2X_RAM_BUDGET */
+typedef char m2x_client_exceeds_ram_budget[M2X_CLIENT_RAM_SIZE <= (M2X_RAM_BUDGET) ? 1 : -1];
+#endif  /* M2X_RAM_BUDGET */
+
 // Implementations
 M2XMQTTClient::M2XMQTTClient(Client* client,
                              const char* key,
@@ -245,10 +614,43 @@ M2XMQTTClient::M2XMQTTClient(Client* client,
                                                         _host(host),
                                                         _port(port),
                                                         _path_prefix(path_prefix),
-                                                        _null_print(),
+                                                        _payload_print(),
                                                         _mmqtt_print(),
-                                                        _current_id(0) {
+                                                        _current_id(0),
+                                                        _response_callback(NULL),
+                                                        _response_context(NULL),
+                                                        _handler_count(0),
+                                                        _parser(),
+                                                        _publish_qos(0),
+                                                        _last_send_ms(0),
+                                                        _ping_sent_ms(0),
+                                                        _next_connect_ms(0),
+                                                        _connect_start_ms(0),
+                                                        _connect_attempts(0),
+                                                        _ping_pending(false),
+                                                        _fast_connect(false),
+                                                        _nonblocking_requests(false),
+                                                        _persistent_session(false),
+                                                        _client_id(NULL),
+                                                        _handshake(0) {
   _key_length = strlen(_key);
+  memset(_pending, 0, sizeof(_pending));
+  memset(&_stats, 0, sizeof(_stats));
+#if M2X_MAX_UNACKED_PUBLISHES > 0
+  for (int i = 0; i < M2X_MAX_UNACKED_PUBLISHES; i++) { _unacked[i].packet_id = 0; }
+  _unacked_head = 0;
+  _unacked_count = 0;
+#endif  /* M2X_MAX_UNACKED_PUBLISHES > 0 */
+  _timer.start();
+  _path_prefix_length = _path_prefix ? strlen(_path_prefix) : 0;
+  /* Cache the request topic ahead of the staged payload, it never changes */
+  _payload_print.reset();
+  _payload_print.write((uint8_t) ((_key_length + 13) >> 8));
+  _payload_print.write((uint8_t) ((_key_length + 13) & 0xFF));
+  M2X_PRINT_LITERAL(&_payload_print, "m2x/");
+  _payload_print.write((const uint8_t *) _key, _key_length);
+  M2X_PRINT_LITERAL(&_payload_print, "/requests");
+  _payload_print.reserve();
 }
 
 mmqtt_status_t m2x_mmqtt_puller(struct mmqtt_connection *connection) {
@@ -268,6 +670,7 @@ mmqtt_status_t m2x_mmqtt_puller(struct mmqtt_connection *connection) {
     c->stop();
     return MMQTT_STATUS_BROKEN_CONNECTION;
   }
+  client->_stats.bytes_out += length;
   mmqtt_stream_external_pull(stream, length);
   if (mmqtt_stream_running(stream) == MMQTT_STATUS_DONE) {
     mmqtt_connection_release_write_stream(connection, stream);
@@ -277,7 +680,7 @@ mmqtt_status_t m2x_mmqtt_puller(struct mmqtt_connection *connection) {
 
 mmqtt_status_t m2x_mmqtt_pusher(struct mmqtt_connection *connection, mmqtt_ssize_t max_size) {
   uint8_t *data = NULL;
-  mmqtt_ssize_t length = 0, i = 0;
+  mmqtt_ssize_t length = 0;
   mmqtt_status_t status;
   M2XMQTTClient *client = (M2XMQTTClient *) connection->connection;
   Client *c = client->_client;
@@ -292,208 +695,622 @@ mmqtt_status_t m2x_mmqtt_pusher(struct mmqtt_connection *connection, mmqtt_ssize
    * so we can handle end condition gracefully? Not 100% if `left` field in
    * mmqtt_stream is enough
    */
-  while (i < length && c->available()) {
-    data[i++] = c->read();
-  }
-  mmqtt_stream_external_push(stream, i);
+  length = c->read(data, length);
+  mmqtt_stream_external_push(stream, length);
   return MMQTT_STATUS_OK;
 }
 
-size_t m2x_mjson_reader(struct mjson_ctx *ctx, char *data, size_t limit)
-{
-  mmqtt_connection *connection = (mmqtt_connection *) ctx->userdata;
-  return mmqtt_s_decode_buffer(connection, m2x_mmqtt_pusher, (uint8_t *) data, limit,
-                               limit) == MMQTT_STATUS_OK ? limit : 0;
-}
-
 int M2XMQTTClient::connectToServer() {
   mmqtt_status_t status;
   struct mmqtt_p_connect_header connect_header;
-  struct mmqtt_p_connack_header connack_header;
   uint32_t packet_length;
-  uint8_t flag;
-  uint16_t length;
   uint8_t name[6];
+  int i;
+  const char* client_id = _client_id ? _client_id : _key;
+  uint16_t client_id_length = strlen(client_id);
 
-  if (_client->connect(_host, _port)) {
-    DBGLN("%s", F("Connected to M2X MQTT server!"));
-    mmqtt_connection_init(&_connection, this);
-    /* Send CONNECT packet first */
-    connect_header.name = name;
-    strncpy((char *)name, F("MQIsdp"), 6);
+  _connect_start_ms = _timer.read_ms64();
+  if (!_client->connect(_host, _port)) {
+    DBGLN("%s", F("ERROR: Cannot connect to M2X MQTT server!"));
+    _stats.tcp_failures++;
+    return E_NOCONNECTION;
+  }
+  DBGLN("%s", F("Connected to M2X MQTT server!"));
+  mmqtt_connection_init(&_connection, this);
+  _mmqtt_print.connection = &_connection;
+  _mmqtt_print.puller = m2x_mmqtt_puller;
+  _mmqtt_print.measured = NULL;
+  _parser.reset();
+  _connected = true;
+  _handshake = M2X_AWAIT_CONNACK | M2X_AWAIT_SUBACK;
+  /* Nothing was received yet, wait for CONNACK like for a PINGRESP so a
+   * server that never answers is detected the same way */
+  _ping_pending = true;
+  _ping_sent_ms = _last_send_ms = _timer.read_ms64();
+  /* Send CONNECT packet first */
+  connect_header.name = name;
+  if (_persistent_session) {
+    /* The session present flag of CONNACK only exists in MQTT 3.1.1 */
+    memcpy(name, F("MQTT"), 4);
+    connect_header.name_length = connect_header.name_max_length = 4;
+    connect_header.protocol_version = 4;
+    /* Username set, session kept */
+    connect_header.flags = 0x80;
+  } else {
+    memcpy(name, F("MQIsdp"), 6);
     connect_header.name_length = connect_header.name_max_length = 6;
     connect_header.protocol_version = 3;
     /* Clean session with username set */
     connect_header.flags = 0x82;
-    connect_header.keepalive = 60;
-    packet_length = mmqtt_s_connect_header_encoded_length(&connect_header) +
-                    mmqtt_s_string_encoded_length(_key_length) +
-                    mmqtt_s_string_encoded_length(_key_length);
-    status = mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
-                                         MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_CONNECT),
-                                         packet_length);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error sending connect packet fixed header: "));
-      DBGLN("%d", status);
-      _client->stop();
-      return E_DISCONNECTED;
-    }
+  }
+  connect_header.keepalive = _keepalive ? M2X_KEEPALIVE_SECONDS : 0;
+  packet_length = mmqtt_s_connect_header_encoded_length(&connect_header) +
+                  mmqtt_s_string_encoded_length(client_id_length) +
+                  mmqtt_s_string_encoded_length(_key_length);
+  status = mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
+                                       MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_CONNECT),
+                                       packet_length);
+  if (status == MMQTT_STATUS_OK) {
     status = mmqtt_s_encode_connect_header(&_connection, m2x_mmqtt_puller, &connect_header);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error sending connect packet variable header: "));
-      DBGLN("%d", status);
-      _client->stop();
-      return E_DISCONNECTED;
-    }
-    /* Client ID */
+  }
+  /* Client ID */
+  if (status == MMQTT_STATUS_OK) {
     status = mmqtt_s_encode_string(&_connection, m2x_mmqtt_puller,
-                                   (const uint8_t *) _key, _key_length);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error sending connect packet payload: "));
-      DBGLN("%d", status);
-      _client->stop();
-      return E_DISCONNECTED;
-    }
-    /* Username */
+                                   (const uint8_t *) client_id, client_id_length);
+  }
+  /* Username */
+  if (status == MMQTT_STATUS_OK) {
     status = mmqtt_s_encode_string(&_connection, m2x_mmqtt_puller,
                                    (const uint8_t *) _key, _key_length);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error sending connect packet payload: "));
-      DBGLN("%d", status);
-      _client->stop();
-      return E_DISCONNECTED;
-    }
-    /* Check CONNACK packet */
-    do {
-      status = mmqtt_s_decode_fixed_header(&_connection, m2x_mmqtt_pusher,
-                                           &flag, &packet_length);
-      if (status != MMQTT_STATUS_OK) {
-        DBG("%s", F("Error decoding connack fixed header: "));
-        DBGLN("%d", status);
-        _client->stop();
-        return E_DISCONNECTED;
-      }
-      if (MMQTT_UNPACK_MESSAGE_TYPE(flag) != MMQTT_MESSAGE_TYPE_CONNACK) {
-        status = mmqtt_s_skip_buffer(&_connection, m2x_mmqtt_pusher, packet_length);
-        if (status != MMQTT_STATUS_OK) {
-          DBG("%s", F("Error skipping non-connack packet: "));
-          DBGLN("%d", status);
-          _client->stop();
-          return E_DISCONNECTED;
-        }
+  }
+  if (status != MMQTT_STATUS_OK) {
+    DBG("%s", F("Error sending connect packet: "));
+    DBGLN("%d", status);
+    close();
+    return E_DISCONNECTED;
+  }
+  /* In fast connect mode SUBSCRIBE follows right away and CONNACK is
+   * checked whenever it arrives */
+  if (!_fast_connect && awaitHandshake(M2X_AWAIT_CONNACK) != E_OK) {
+    return E_DISCONNECTED;
+  }
+  /* Send SUBSCRIBE packet, unless the server still has the subscription
+   * of a persistent session */
+  if (_handshake & M2X_AWAIT_SUBACK) {
+    /* Packet identifier and the responses topic, then one topic per type */
+    packet_length = 2 + _key_length + 17;
+    for (i = 0; i < _handler_count; i++) {
+      if (subscribesTo(&_handlers[i])) {
+        packet_length += _key_length + 8 + strlen(_handlers[i].type);
       }
-    } while (MMQTT_UNPACK_MESSAGE_TYPE(flag) != MMQTT_MESSAGE_TYPE_CONNACK);
-    status = mmqtt_s_decode_connack_header(&_connection, m2x_mmqtt_pusher,
-                                           &connack_header);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error decoding connack variable header: "));
-      DBGLN("%d", status);
-      _client->stop();
-      return E_DISCONNECTED;
-    }
-    if (connack_header.return_code != 0x0) {
-      DBG("%s", F("CONNACK return code is not accepted: "));
-      DBGLN("%d", connack_header.return_code);
-      _client->stop();
-      return E_DISCONNECTED;
     }
-    /* Send SUBSCRIBE packet*/
-    length = _key_length + 15 + 4;
     status = mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
                                          MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_SUBSCRIBE) | 0x2,
-                                         length);
+                                         packet_length);
     if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error sending subscribe packet fixed header: "));
+      DBG("%s", F("Error sending subscribe packet: "));
       DBGLN("%d", status);
-      _client->stop();
+      close();
       return E_DISCONNECTED;
     }
     // Subscribe packet must use QoS 1
-    mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, 0);
-    mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 14);
-    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
-    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
-    // The extra one is QoS, added here to save a function call
-    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/responses\0"), 11);
-    /* Check SUBACK packet */
-    do {
-      status = mmqtt_s_decode_fixed_header(&_connection, m2x_mmqtt_pusher,
-                                           &flag, &packet_length);
-      if (status != MMQTT_STATUS_OK) {
-        DBG("%s", F("Error decoding suback fixed header: "));
-        DBGLN("%d", status);
-        _client->stop();
-        return E_DISCONNECTED;
+    mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, M2X_SUBSCRIBE_PACKET_ID);
+    encodeSubscription(F("responses"), 9);
+    for (i = 0; i < _handler_count; i++) {
+      if (subscribesTo(&_handlers[i])) {
+        encodeSubscription(_handlers[i].type, strlen(_handlers[i].type));
       }
-      if (MMQTT_UNPACK_MESSAGE_TYPE(flag) != MMQTT_MESSAGE_TYPE_SUBACK) {
-        status = mmqtt_s_skip_buffer(&_connection, m2x_mmqtt_pusher, packet_length);
-        if (status != MMQTT_STATUS_OK) {
-          DBG("%s", F("Error skipping packet: "));
-          DBGLN("%d", status);
-          _client->stop();
-          return E_DISCONNECTED;
-        }
+    }
+  }
+  /* The server handles packets in order, so responses to these can only
+   * come after the subscription is in place */
+  resendUnackedPublishes();
+  if (!_fast_connect) { return awaitHandshake(M2X_AWAIT_SUBACK); }
+  return E_OK;
+}
+
+// Writes the topic filter m2x/<key>/<+type+> of a SUBSCRIBE packet and
+// its requested QoS
+void M2XMQTTClient::encodeSubscription(const char* type, size_t type_length) {
+  mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 5 + type_length);
+  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
+  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
+  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) "/", 1);
+  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) type, type_length);
+  /* Requested QoS, messages are only queued for an offline client of a
+   * persistent session when subscribed with QoS 1 */
+  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller,
+                        (const uint8_t *) (_persistent_session ? "\1" : "\0"), 1);
+}
+
+// Reads packets until none of the handshake steps in +mask+ is still
+// awaited. Returns E_DISCONNECTED if the server rejected the connection or
+// closed it.
+int M2XMQTTClient::awaitHandshake(uint8_t mask) {
+  int ret;
+
+  while (_connected && (_handshake & mask)) {
+    ret = readPacket(true);
+    if (ret == E_NOT_READY) { continue; }
+    if (ret != E_OK) { break; }
+    handlePacket();
+  }
+  return _connected ? E_OK : E_DISCONNECTED;
+}
+
+// Checks a CONNACK or SUBACK received while connecting, closes the
+// connection if the server refused it
+void M2XMQTTClient::handleHandshake() {
+  if (_parser.type() == MMQTT_MESSAGE_TYPE_CONNACK) {
+    if (!(_handshake & M2X_AWAIT_CONNACK)) { return; }
+    if (_parser.header_length < 2 || _parser.header[1] != 0) {
+      DBG("%s", F("CONNACK return code is not accepted: "));
+      DBGLN("%d", _parser.header[1]);
+      close();
+      return;
+    }
+    _handshake &= ~M2X_AWAIT_CONNACK;
+    /* Without fast connect SUBSCRIBE isn't sent yet, and isn't needed if
+     * the server kept the session */
+    if (_persistent_session && !_fast_connect && (_parser.header[0] & 0x01)) {
+      DBGLN("%s", F("Resuming persistent session"));
+      _handshake &= ~M2X_AWAIT_SUBACK;
+    }
+  } else if (_parser.type() == MMQTT_MESSAGE_TYPE_SUBACK &&
+             _parser.packet_id == M2X_SUBSCRIBE_PACKET_ID &&
+             (_handshake & M2X_AWAIT_SUBACK)) {
+    if (_parser.header_length < 3 || _parser.header[2] == 0x80) {
+      DBGLN("%s", F("Subscription to the responses topic was refused!"));
+      close();
+      return;
+    }
+    /* The other topics only matter to their handlers */
+    for (int i = 3; i < _parser.header_length; i++) {
+      if (_parser.header[i] == 0x80) {
+        DBGLN("%s", F("Subscription to a message topic was refused!"));
       }
-    } while (MMQTT_UNPACK_MESSAGE_TYPE(flag) != MMQTT_MESSAGE_TYPE_SUBACK);
-    status = mmqtt_s_skip_buffer(&_connection, m2x_mmqtt_pusher, packet_length);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error skipping suback packet: "));
-      DBGLN("%d", status);
-      _client->stop();
-      return E_DISCONNECTED;
     }
-    _mmqtt_print.connection = &_connection;
-    _mmqtt_print.puller = m2x_mmqtt_puller;
-    _connected = true;
-    return E_OK;
-  } else {
-    DBGLN("%s", F("ERROR: Cannot connect to M2X MQTT server!"));
+    _handshake &= ~M2X_AWAIT_SUBACK;
+  }
+  if (_handshake == 0) {
+    _connect_attempts = 0;
+    if (_stats.connect_ms.count > 0) { _stats.reconnects++; }
+    _stats.connect_ms.add((unsigned long) (_timer.read_ms64() - _connect_start_ms));
+  }
+}
+
+// Connects unless already connected. While connection attempts keep
+// failing, they are spaced out with a jittered exponential backoff and
+// E_NOCONNECTION is returned right away until the next one is due.
+int M2XMQTTClient::ensureConnected() {
+  int ret;
+
+  if (_connected) { return E_OK; }
+  if (_connect_attempts > 0 && _timer.read_ms64() < _next_connect_ms) {
     return E_NOCONNECTION;
   }
+  /* _connect_attempts is reset once the handshake completes */
+  ret = connectToServer();
+  if (ret == E_OK) { return E_OK; }
+  /* Handshake failures already backed off when closing */
+  if (ret == E_NOCONNECTION) { scheduleReconnect(); }
+  return E_NOCONNECTION;
 }
 
-template <class T>
-int M2XMQTTClient::updateStreamValue(const char* deviceId, const char* streamName, T value) {
-  int length;
+// Sets when the next connection attempt is due after one failed
+void M2XMQTTClient::scheduleReconnect() {
+  unsigned long delay_ms;
+
+  delay_ms = M2X_RECONNECT_MAX_MS;
+  if (_connect_attempts < 16 &&
+      ((unsigned long) M2X_RECONNECT_MIN_MS << _connect_attempts) < delay_ms) {
+    delay_ms = (unsigned long) M2X_RECONNECT_MIN_MS << _connect_attempts;
+  }
+  /* Randomize the second half of the delay so that many devices losing
+   * the same link don't all come back at once */
+  delay_ms = delay_ms / 2 + rand() % (delay_ms / 2 + 1);
+  _next_connect_ms = _timer.read_ms64() + delay_ms;
+  if (_connect_attempts < 0xFF) { _connect_attempts++; }
+}
+
+// Sends a PINGREQ once nothing was sent for half the keepalive interval.
+// Returns false if the last PINGREQ went unanswered for too long, which
+// means the connection is dead.
+bool M2XMQTTClient::keepAlive() {
+  static const uint8_t pingreq[2] = {
+    MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PINGREQ), 0
+  };
+  uint64_t now;
+
+  if (!_keepalive) { return true; }
+  now = _timer.read_ms64();
+  if (_ping_pending) {
+    return now - _ping_sent_ms < M2X_PING_TIMEOUT_MS;
+  }
+  if (now - _last_send_ms >= M2X_KEEPALIVE_SECONDS * 500UL) {
+    _client->write(pingreq, sizeof(pingreq));
+    _client->flush();
+    _stats.bytes_out += sizeof(pingreq);
+    _ping_pending = true;
+    _ping_sent_ms = _last_send_ms = now;
+  }
+  return true;
+}
+
+// Connects if needed and claims a pending table slot for the next request
+// ID, reading responses until the slot is free if an older request still
+// occupies it. The older request frees it at the latest once it times out.
+// With non-blocking requests, only the responses already available are
+// read and E_NOT_READY is returned if the slot is still taken.
+int M2XMQTTClient::beginRequest() {
+  int16_t id;
+  M2XPendingRequest* slot;
+  int ret;
+
+  if (ensureConnected() != E_OK) {
+    DBGLN("%s", "ERROR: Cannot connect to M2X server!");
+    return E_NOCONNECTION;
+  }
+  id = (_current_id == 0x7FFF) ? 1 : _current_id + 1;
+  slot = &_pending[id % M2X_MAX_PENDING_REQUESTS];
+  while ((slot->id != 0 && !slot->done) || (_publish_qos && unackedFull())) {
+    ret = readPacket(!_nonblocking_requests);
+    if (ret == E_NOT_READY) {
+      if (_nonblocking_requests) { return E_NOT_READY; }
+      continue;
+    }
+    if (ret != E_OK) { return E_DISCONNECTED; }
+    handlePacket();
+  }
+  _current_id = id;
+  slot->id = id;
+  slot->status = 0;
+  slot->notify = true;
+  slot->done = false;
+  slot->sent_ms = _timer.read_ms64();
+  _stats.requests++;
+  return E_OK;
+}
+
+// Turns a request submitted asynchronously into a synchronous one: waits
+// for the response of +id+ and returns its status code instead of passing
+// it to the response callback.
+int M2XMQTTClient::waitForResponse(int id) {
+  M2XPendingRequest* slot;
+  bool reconnected = false;
+  int ret;
+
+  if (id < 0) { return id; }
+  slot = &_pending[id % M2X_MAX_PENDING_REQUESTS];
+  slot->notify = false;
+  while (!slot->done) {
+    ret = readPacket(true);
+    if (ret == E_OK) {
+      handlePacket();
+    } else if (ret == E_NOT_READY) {
+      /* A request timed out, maybe this one */
+      continue;
+    } else if (reconnected || slot->done || ensureConnected() != E_OK) {
+      /* Unacknowledged QoS 1 requests survive one reconnect, which sends
+       * them again */
+      break;
+    } else {
+      reconnected = true;
+    }
+  }
+  slot->id = 0;
+  return slot->done ? slot->status : E_DISCONNECTED;
+}
+
+// Stores or delivers the status of request +id+, returns false if no
+// such request is pending.
+bool M2XMQTTClient::completeRequest(int16_t id, int status) {
+  M2XPendingRequest* slot;
+
+  if (id <= 0) { return false; }
+  slot = &_pending[id % M2X_MAX_PENDING_REQUESTS];
+  /* Responses to requests we no longer track are dropped */
+  if (slot->id != id || slot->done) { return false; }
+  if (slot->notify) {
+    slot->id = 0;
+    if (_response_callback) { _response_callback(id, status, _response_context); }
+  } else {
+    slot->status = status;
+    slot->done = true;
+  }
+  return true;
+}
+
+void M2XMQTTClient::failPendingRequests(int status) {
+  for (int i = 0; i < M2X_MAX_PENDING_REQUESTS; i++) {
+    if (_pending[i].id != 0 && !_pending[i].done && !isUnacked(_pending[i].id)) {
+      completeRequest(_pending[i].id, status);
+    }
+  }
+}
+
+// Completes the requests that waited longer than M2X_REQUEST_TIMEOUT_MS for
+// their response with E_TIMEOUT. Returns true if any did.
+bool M2XMQTTClient::expireRequests() {
+  uint64_t now = _timer.read_ms64();
+  bool expired = false;
+
+  for (int i = 0; i < M2X_MAX_PENDING_REQUESTS; i++) {
+    if (_pending[i].id != 0 && !_pending[i].done &&
+        now - _pending[i].sent_ms >= M2X_REQUEST_TIMEOUT_MS) {
+      DBGLN("Request %d timed out", _pending[i].id);
+      _stats.request_timeouts++;
+      completeRequest(_pending[i].id, E_TIMEOUT);
+      expired = true;
+    }
+  }
+  return expired;
+}
+
+void M2XMQTTClient::setResponseCallback(M2XResponseCallback callback, void* context) {
+  _response_callback = callback;
+  _response_context = context;
+}
+
+int M2XMQTTClient::setMessageHandler(const char* type, M2XMessageHandler handler,
+                                     void* context) {
+  int i;
+
+  if (type && strlen(type) > M2X_MESSAGE_TYPE_SIZE) { return E_INVALID; }
+  for (i = 0; i < _handler_count; i++) {
+    if (_handlers[i].type == type ||
+        (type && _handlers[i].type && strcmp(_handlers[i].type, type) == 0)) {
+      break;
+    }
+  }
+  if (handler == NULL) {
+    /* Removing, the last entry takes the place of this one */
+    if (i < _handler_count) { _handlers[i] = _handlers[--_handler_count]; }
+  } else {
+    if (i == M2X_MAX_MESSAGE_HANDLERS) { return E_BUFFER_TOO_SMALL; }
+    if (i == _handler_count) { _handler_count++; }
+    _handlers[i].type = type;
+    _handlers[i].handler = handler;
+    _handlers[i].context = context;
+  }
+  /* Payloads are only worth copying when someone looks at them */
+  _parser.setMessageBuffer(_handler_count ? _message : NULL, sizeof(_message));
+  return E_OK;
+}
+
+// Passes the PUBLISH just parsed to the handler of its type, or to the
+// catch-all handler. Returns false if neither is registered.
+bool M2XMQTTClient::dispatchMessage() {
+  M2XMessageHandlerEntry* entry = NULL;
+  M2XMessage message;
+  int i;
+
+  if (_parser.message_type_length > M2X_MESSAGE_TYPE_SIZE) { return false; }
+  for (i = 0; i < _handler_count; i++) {
+    if (_handlers[i].type == NULL) {
+      if (entry == NULL) { entry = &_handlers[i]; }
+    } else if (strcmp(_handlers[i].type, _parser.message_type) == 0) {
+      entry = &_handlers[i];
+      break;
+    }
+  }
+  if (entry == NULL) { return false; }
+  message.type = _parser.message_type;
+  message.payload = _message;
+  message.truncated = _parser.message_length >= sizeof(_message);
+  message.length = message.truncated ? sizeof(_message) - 1 : _parser.message_length;
+  entry->handler(&message, entry->context);
+  return true;
+}
+
+int M2XMQTTClient::poll() {
+  int count = 0, ret;
+
   if (!_connected) {
-    if (connectToServer() != E_OK) {
-      DBGLN("%s", "ERROR: Cannot connect to M2X server!");
-      return E_NOCONNECTION;
+    if (!_keepalive) { return 0; }
+    if (ensureConnected() != E_OK) { return E_NOCONNECTION; }
+  }
+  while (_connected) {
+    ret = readPacket(false);
+    if (ret == E_NOT_READY) { break; }
+    if (ret != E_OK) { return E_DISCONNECTED; }
+    if (handlePacket()) { count++; }
+  }
+  return count;
+}
+
+int M2XMQTTClient::pendingRequests() const {
+  int count = 0;
+  for (int i = 0; i < M2X_MAX_PENDING_REQUESTS; i++) {
+    if (_pending[i].id != 0 && !_pending[i].done) { count++; }
+  }
+  return count;
+}
+
+void M2XMQTTClient::setPublishQoS(uint8_t qos) {
+  _publish_qos = qos ? 1 : 0;
+}
+
+/* Without retransmit slots QoS 1 requests are published but never kept */
+#if M2X_MAX_UNACKED_PUBLISHES > 0
+int M2XMQTTClient::unackedPublishes() const {
+  int count = 0;
+  for (int i = 0; i < M2X_MAX_UNACKED_PUBLISHES; i++) {
+    if (_unacked[i].packet_id != 0) { count++; }
+  }
+  return count;
+}
+
+bool M2XMQTTClient::isUnacked(int16_t id) const {
+  for (int i = 0; i < M2X_MAX_UNACKED_PUBLISHES; i++) {
+    if (_unacked[i].packet_id == (uint16_t) id) { return true; }
+  }
+  return false;
+}
+
+bool M2XMQTTClient::unackedFull() const {
+  return _unacked_count == M2X_MAX_UNACKED_PUBLISHES;
+}
+
+// Frees the retransmit slot of +packet_id+. Slots are handed out in order,
+// so the queue only shrinks from its head to keep resends in order too.
+void M2XMQTTClient::ackPublish(uint16_t packet_id) {
+  int i;
+
+  if (packet_id == 0) { return; }
+  for (i = 0; i < _unacked_count; i++) {
+    M2XUnackedPublish* slot = &_unacked[(_unacked_head + i) % M2X_MAX_UNACKED_PUBLISHES];
+    if (slot->packet_id == packet_id) {
+      slot->packet_id = 0;
+      break;
     }
   }
-  _current_id++;
-  length = printUpdateStreamValuePayload(&_null_print, deviceId, streamName, value);
+  while (_unacked_count > 0 && _unacked[_unacked_head].packet_id == 0) {
+    _unacked_head = (_unacked_head + 1) % M2X_MAX_UNACKED_PUBLISHES;
+    _unacked_count--;
+  }
+}
+
+// Sends the QoS 1 requests the server hasn't acknowledged again after a
+// reconnect, with the DUP flag set
+void M2XMQTTClient::resendUnackedPublishes() {
+  for (int i = 0; i < _unacked_count; i++) {
+    M2XUnackedPublish* slot = &_unacked[(_unacked_head + i) % M2X_MAX_UNACKED_PUBLISHES];
+    if (slot->packet_id == 0) { continue; }
+    DBGLN("Resending request %d", slot->packet_id);
+    mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
+                                MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH) | 0x0A,
+                                slot->length + _key_length + 17);
+    _last_send_ms = _timer.read_ms64();
+    sendRequestTopic();
+    mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, slot->packet_id);
+    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, slot->payload, slot->length);
+  }
+}
+
+// Keeps the QoS 1 request just sent until the server acknowledges it
+void M2XMQTTClient::keepUnacked(const uint8_t* payload, size_t length) {
+  /* beginRequest() made sure there is a free slot */
+  M2XUnackedPublish* slot = &_unacked[(_unacked_head + _unacked_count) % M2X_MAX_UNACKED_PUBLISHES];
+  slot->packet_id = _current_id;
+  slot->length = length;
+  memcpy(slot->payload, payload, length);
+  _unacked_count++;
+}
+#else
+int M2XMQTTClient::unackedPublishes() const { return 0; }
+bool M2XMQTTClient::isUnacked(int16_t) const { return false; }
+bool M2XMQTTClient::unackedFull() const { return false; }
+void M2XMQTTClient::ackPublish(uint16_t) {}
+void M2XMQTTClient::resendUnackedPublishes() {}
+void M2XMQTTClient::keepUnacked(const uint8_t*, size_t) {}
+#endif  /* M2X_MAX_UNACKED_PUBLISHES > 0 */
+
+// Acknowledges a response the server published with QoS 1
+void M2XMQTTClient::sendPuback(uint16_t packet_id) {
+  uint8_t puback[4] = {
+    MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBACK), 2,
+    (uint8_t) (packet_id >> 8), (uint8_t) (packet_id & 0xFF)
+  };
+
+  _client->write(puback, sizeof(puback));
+  _stats.bytes_out += sizeof(puback);
+  _last_send_ms = _timer.read_ms64();
+}
+
+// Sends the PUBLISH request staged in +_payload_print+. Returns false if the
+// payload didn't fit in the buffer, in which case only the fixed header and
+// topic are sent and the payload has to be printed into the MQTT stream.
+bool M2XMQTTClient::sendStagedPublish() {
+  size_t payload_length = _payload_print.length - _payload_print.reserved;
+  const uint8_t* payload = _payload_print.buffer + _payload_print.reserved;
+
+  _last_send_ms = _timer.read_ms64();
   mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
-                              MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH),
-                              length + _key_length + 15);
-  mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 13);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/requests"), 9);
-  printUpdateStreamValuePayload(&_mmqtt_print, deviceId, streamName, value);
-  return readStatusCode();
+                              MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH) |
+                              (_publish_qos << 1),
+                              payload_length + _key_length + 15 + (_publish_qos ? 2 : 0));
+  if (!_publish_qos && !_payload_print.overflowed()) {
+    /* The cached topic and the payload are contiguous */
+    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller,
+                          _payload_print.buffer, _payload_print.length);
+    return true;
+  }
+  sendRequestTopic();
+  if (_publish_qos) {
+    mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _current_id);
+  }
+  if (_payload_print.overflowed()) {
+    _stats.two_pass++;
+    /* The second pass reuses the precisions the first one found */
+    _mmqtt_print.measured = &_payload_print;
+    _mmqtt_print.measured_next = 0;
+    return false;
+  }
+  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, payload, payload_length);
+  if (_publish_qos) { keepUnacked(payload, payload_length); }
+  return true;
+}
+
+// Sends the length prefixed request topic
+void M2XMQTTClient::sendRequestTopic() {
+  if (_payload_print.reserved <= sizeof(_payload_print.buffer)) {
+    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller,
+                          _payload_print.buffer, _payload_print.reserved);
+  } else {
+    /* Key is too long to have the topic cached */
+    mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 13);
+    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
+    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
+    mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/requests"), 9);
+  }
+}
+
+// Prints the request envelope from the opening brace up to the device ID
+// in the resource path.
+int M2XMQTTClient::printRequestStart(Print* print, const char* method,
+                                     size_t method_length) {
+  int bytes = 0;
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_ID);
+  bytes += print->print(_current_id);
+  bytes += print->write((const uint8_t *) method, method_length);
+  if (_path_prefix) {
+    bytes += print->write((const uint8_t *) _path_prefix, _path_prefix_length);
+  }
+  bytes += M2X_PRINT_LITERAL(print, M2X_DEVICES_PATH);
+  return bytes;
+}
+
+template <class T>
+int M2XMQTTClient::updateStreamValue(const char* deviceId, const char* streamName, T value) {
+  return waitForResponse(updateStreamValueAsync(deviceId, streamName, value));
+}
+
+template <class T>
+int M2XMQTTClient::updateStreamValueAsync(const char* deviceId, const char* streamName, T value) {
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  _payload_print.reset();
+  printUpdateStreamValuePayload(&_payload_print, deviceId, streamName, value);
+  if (!sendStagedPublish()) {
+    printUpdateStreamValuePayload(&_mmqtt_print, deviceId, streamName, value);
+  }
+  return _current_id;
 }
 
 template <class T>
 int M2XMQTTClient::printUpdateStreamValuePayload(Print* print, const char* deviceId,
                                                  const char* streamName, T value) {
   int bytes = 0;
-  bytes += print->print(F("{\"id\":\""));
-  bytes += print->print(_current_id);
-  bytes += print->print(F("\",\"method\":\"PUT\",\"resource\":\""));
-  if (_path_prefix) { bytes += print->print(_path_prefix); }
-  bytes += print->print(F("/v2/devices/"));
+  bytes += printRequestStart(print, M2X_METHOD_PUT, sizeof(M2X_METHOD_PUT) - 1);
   bytes += print->print(deviceId);
-  bytes += print->print(F("/streams/"));
+  bytes += M2X_PRINT_LITERAL(print, "/streams/");
   bytes += print->print(streamName);
-  bytes += print->print(F("/value"));
-  bytes += print->print(F("\",\"agent\":\""));
-  bytes += print->print(USER_AGENT);
-  bytes += print->print(F("\",\"body\":"));
-  bytes += print->print(F("{\"value\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "/value");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"value\":\"");
   bytes += print->print(value);
-  bytes += print->print(F("\"}"));
-  bytes += print->print(F("}"));
+  bytes += M2X_PRINT_LITERAL(print, "\"}}");
   return bytes;
 }
 
@@ -501,62 +1318,132 @@ template <class T>
 int M2XMQTTClient::postDeviceUpdates(const char* deviceId, int streamNum,
                                      const char* names[], const int counts[],
                                      const char* ats[], T values[]) {
-  int length;
-  if (!_connected) {
-    if (connectToServer() != E_OK) {
-      DBGLN("%s", "ERROR: Cannot connect to M2X server!");
-      return E_NOCONNECTION;
-    }
-  }
-  _current_id++;
-  length = printPostDeviceUpdatesPayload(&_null_print, deviceId, streamNum,
-                                         names, counts, ats, values);
-  mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
-                              MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH),
-                              length + _key_length + 15);
-  mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 13);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/requests"), 9);
-  printPostDeviceUpdatesPayload(&_mmqtt_print, deviceId, streamNum,
-                                names, counts, ats, values);
-  return readStatusCode();
+  return waitForResponse(postDeviceUpdatesAsync(deviceId, streamNum,
+                                                names, counts, ats, values));
 }
 
 template <class T>
+int M2XMQTTClient::postDeviceUpdates(const char* deviceId, int streamNum,
+                                     const char* names[], const int counts[],
+                                     const int64_t ats[], T values[]) {
+  return waitForResponse(postDeviceUpdatesAsync(deviceId, streamNum,
+                                                names, counts, ats, values));
+}
+
+template <class T>
+int M2XMQTTClient::postDeviceUpdatesAsync(const char* deviceId, int streamNum,
+                                          const char* names[], const int counts[],
+                                          const char* ats[], T values[]) {
+  return sendPostDeviceUpdates(deviceId, streamNum, names, counts, ats, values);
+}
+
+template <class T>
+int M2XMQTTClient::postDeviceUpdatesAsync(const char* deviceId, int streamNum,
+                                          const char* names[], const int counts[],
+                                          const int64_t ats[], T values[]) {
+  return sendPostDeviceUpdates(deviceId, streamNum, names, counts, ats, values);
+}
+
+template <class T, class A>
+int M2XMQTTClient::sendPostDeviceUpdates(const char* deviceId, int streamNum,
+                                         const char* names[], const int counts[],
+                                         A ats[], T values[]) {
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  _payload_print.reset();
+  printPostDeviceUpdatesPayload(&_payload_print, deviceId, streamNum,
+                                names, counts, ats, values);
+  if (!sendStagedPublish()) {
+    printPostDeviceUpdatesPayload(&_mmqtt_print, deviceId, streamNum,
+                                  names, counts, ats, values);
+  }
+  return _current_id;
+}
+
+template <class T, class A>
 int M2XMQTTClient::printPostDeviceUpdatesPayload(Print* print,
                                                  const char* deviceId, int streamNum,
                                                  const char* names[], const int counts[],
-                                                 const char* ats[], T values[]) {
+                                                 A ats[], T values[]) {
+  M2XTimestampFormatter formatter;
   int bytes = 0, value_index = 0, i, j;
-  bytes += print->print(F("{\"id\":\""));
-  bytes += print->print(_current_id);
-  bytes += print->print(F("\",\"method\":\"POST\",\"resource\":\""));
-  if (_path_prefix) { bytes += print->print(_path_prefix); }
-  bytes += print->print(F("/v2/devices/"));
+  bytes += printRequestStart(print, M2X_METHOD_POST, sizeof(M2X_METHOD_POST) - 1);
   bytes += print->print(deviceId);
-  bytes += print->print(F("/updates"));
-  bytes += print->print(F("\",\"agent\":\""));
-  bytes += print->print(USER_AGENT);
-  bytes += print->print(F("\",\"body\":"));
-  bytes += print->print(F("{\"values\":{"));
+  bytes += M2X_PRINT_LITERAL(print, "/updates");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"values\":{");
   for (i = 0; i < streamNum; i++) {
-    bytes += print->print(F("\""));
+    bytes += M2X_PRINT_LITERAL(print, "\"");
     bytes += print->print(names[i]);
-    bytes += print->print(F("\":["));
+    bytes += M2X_PRINT_LITERAL(print, "\":[");
     for (j = 0; j < counts[i]; j++) {
-      bytes += print->print(F("{\"timestamp\": \""));
-      bytes += print->print(ats[value_index]);
-      bytes += print->print(F("\",\"value\": \""));
+      bytes += M2X_PRINT_LITERAL(print, "{\"timestamp\": \"");
+      bytes += m2x_print_timestamp(print, ats[value_index], &formatter);
+      bytes += M2X_PRINT_LITERAL(print, "\",\"value\": \"");
       bytes += print->print(values[value_index]);
-      bytes += print->print(F("\"}"));
-      if (j < counts[i] - 1) { bytes += print->print(F(",")); }
+      bytes += M2X_PRINT_LITERAL(print, "\"}");
+      if (j < counts[i] - 1) { bytes += M2X_PRINT_LITERAL(print, ","); }
       value_index++;
     }
-    bytes += print->print(F("]"));
-    if (i < streamNum - 1) { bytes += print->print(F(",")); }
+    bytes += M2X_PRINT_LITERAL(print, "]");
+    if (i < streamNum - 1) { bytes += M2X_PRINT_LITERAL(print, ","); }
+  }
+  bytes += M2X_PRINT_LITERAL(print, "}}}");
+  return bytes;
+}
+
+int M2XMQTTClient::postDeviceUpdates(const char* deviceId, const M2XBatch& batch) {
+  return waitForResponse(postDeviceUpdatesAsync(deviceId, batch));
+}
+
+int M2XMQTTClient::postDeviceUpdatesAsync(const char* deviceId, const M2XBatch& batch) {
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  _payload_print.reset();
+  printPostDeviceUpdatesPayload(&_payload_print, deviceId, batch);
+  if (!sendStagedPublish()) {
+    printPostDeviceUpdatesPayload(&_mmqtt_print, deviceId, batch);
+  }
+  return _current_id;
+}
+
+int M2XMQTTClient::printPostDeviceUpdatesPayload(Print* print, const char* deviceId,
+                                                 const M2XBatch& batch) {
+  M2XTimestampFormatter formatter;
+  const M2XBatchStream* s;
+  bool first = true;
+  int bytes = 0, i, j;
+
+  bytes += printRequestStart(print, M2X_METHOD_POST, sizeof(M2X_METHOD_POST) - 1);
+  bytes += print->print(deviceId);
+  bytes += M2X_PRINT_LITERAL(print, "/updates");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"values\":{");
+  for (i = 0; i < batch.streamCount(); i++) {
+    s = batch.stream(i);
+    if (s->count == 0) { continue; }
+    if (!first) { bytes += M2X_PRINT_LITERAL(print, ","); }
+    first = false;
+    bytes += M2X_PRINT_LITERAL(print, "\"");
+    bytes += print->write((const uint8_t *) s->name, s->name_length);
+    bytes += M2X_PRINT_LITERAL(print, "\":[");
+    for (j = 0; j < s->count; j++) {
+      if (j > 0) { bytes += M2X_PRINT_LITERAL(print, ","); }
+      bytes += M2X_PRINT_LITERAL(print, "{\"timestamp\": \"");
+      bytes += m2x_print_timestamp(print, s->ats[j], &formatter);
+      bytes += M2X_PRINT_LITERAL(print, "\",\"value\": \"");
+      if (s->type == M2X_BATCH_DOUBLE) {
+        bytes += print->print(((const double*) s->values)[j]);
+      } else if (s->type == M2X_BATCH_FLOAT) {
+        bytes += print->print(((const float*) s->values)[j]);
+      } else {
+        bytes += print->print((long) ((const int32_t*) s->values)[j]);
+      }
+      bytes += M2X_PRINT_LITERAL(print, "\"}");
+    }
+    bytes += M2X_PRINT_LITERAL(print, "]");
   }
-  bytes += print->print(F(("}}}")));
+  bytes += M2X_PRINT_LITERAL(print, "}}}");
   return bytes;
 }
 
@@ -564,26 +1451,40 @@ template <class T>
 int M2XMQTTClient::postDeviceUpdate(const char* deviceId, int streamNum,
                                     const char* names[], T values[],
                                     const char* at) {
-  int length;
-  if (!_connected) {
-    if (connectToServer() != E_OK) {
-      DBGLN("%s", "ERROR: Cannot connect to M2X server!");
-      return E_NOCONNECTION;
-    }
-  }
-  _current_id++;
-  length = printPostDeviceUpdatePayload(&_null_print, deviceId, streamNum,
-                                        names, values, at);
-  mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
-                              MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH),
-                              length + _key_length + 15);
-  mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 13);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/requests"), 9);
-  printPostDeviceUpdatePayload(&_mmqtt_print, deviceId, streamNum,
+  return waitForResponse(postDeviceUpdateAsync(deviceId, streamNum,
+                                               names, values, at));
+}
+
+template <class T>
+int M2XMQTTClient::postDeviceUpdateMs(const char* deviceId, int streamNum,
+                                      const char* names[], T values[], int64_t at) {
+  return waitForResponse(postDeviceUpdateMsAsync(deviceId, streamNum,
+                                                 names, values, at));
+}
+
+template <class T>
+int M2XMQTTClient::postDeviceUpdateMsAsync(const char* deviceId, int streamNum,
+                                           const char* names[], T values[], int64_t at) {
+  char buffer[M2X_ISO8601_LENGTH + 1];
+
+  m2x_format_iso8601(buffer, at);
+  return postDeviceUpdateAsync(deviceId, streamNum, names, values, (const char*) buffer);
+}
+
+template <class T>
+int M2XMQTTClient::postDeviceUpdateAsync(const char* deviceId, int streamNum,
+                                         const char* names[], T values[],
+                                         const char* at) {
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  _payload_print.reset();
+  printPostDeviceUpdatePayload(&_payload_print, deviceId, streamNum,
                                names, values, at);
-  return readStatusCode();
+  if (!sendStagedPublish()) {
+    printPostDeviceUpdatePayload(&_mmqtt_print, deviceId, streamNum,
+                                 names, values, at);
+  }
+  return _current_id;
 }
 
 template <class T>
@@ -591,59 +1492,50 @@ int M2XMQTTClient::printPostDeviceUpdatePayload(Print* print,
                                                 const char* deviceId, int streamNum,
                                                 const char* names[], T values[],
                                                 const char* at) {
-  int bytes = 0, i;
-  bytes += print->print(F("{\"id\":\""));
-  bytes += print->print(_current_id);
-  bytes += print->print(F("\",\"method\":\"POST\",\"resource\":\""));
-  if (_path_prefix) { bytes += print->print(_path_prefix); }
-  bytes += print->print(F("/v2/devices/"));
+  int bytes = 0;
+  bytes += printRequestStart(print, M2X_METHOD_POST, sizeof(M2X_METHOD_POST) - 1);
   bytes += print->print(deviceId);
-  bytes += print->print(F("/update"));
-  bytes += print->print(F("\",\"agent\":\""));
-  bytes += print->print(USER_AGENT);
-  bytes += print->print(F("\",\"body\":"));
-  bytes += print->print(F("{\"values\":{"));
+  bytes += M2X_PRINT_LITERAL(print, "/update");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"values\":{");
   for (int i = 0; i < streamNum; i++) {
-    bytes += print->print(F("\""));
+    bytes += M2X_PRINT_LITERAL(print, "\"");
     bytes += print->print(names[i]);
-    bytes += print->print(F("\": \""));
+    bytes += M2X_PRINT_LITERAL(print, "\": \"");
     bytes += print->print(values[i]);
-    bytes += print->print(F("\""));
-    if (i < streamNum - 1) { bytes += print->print(F(",")); }
+    bytes += M2X_PRINT_LITERAL(print, "\"");
+    if (i < streamNum - 1) { bytes += M2X_PRINT_LITERAL(print, ","); }
   }
-  bytes += print->print(F("}"));
+  bytes += M2X_PRINT_LITERAL(print, "}");
   if (at != NULL) {
-    bytes += print->print(F(",\"timestamp\":\""));
+    bytes += M2X_PRINT_LITERAL(print, ",\"timestamp\":\"");
     bytes += print->print(at);
-    bytes += print->print(F("\""));
+    bytes += M2X_PRINT_LITERAL(print, "\"");
   }
-  bytes += print->print(F(("}")));
+  bytes += M2X_PRINT_LITERAL(print, "}}");
   return bytes;
 }
 
 template <class T>
 int M2XMQTTClient::updateLocation(const char* deviceId, const char* name,
                                   T latitude, T longitude, T elevation) {
-  int length;
-  if (!_connected) {
-    if (connectToServer() != E_OK) {
-      DBGLN("%s", "ERROR: Cannot connect to M2X server!");
-      return E_NOCONNECTION;
-    }
-  }
-  _current_id++;
-  length = printUpdateLocationPayload(&_null_print, deviceId, name,
-                                      latitude, longitude, elevation);
-  mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
-                              MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH),
-                              length + _key_length + 15);
-  mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 13);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/requests"), 9);
-  printUpdateLocationPayload(&_mmqtt_print, deviceId, name,
+  return waitForResponse(updateLocationAsync(deviceId, name,
+                                             latitude, longitude, elevation));
+}
+
+template <class T>
+int M2XMQTTClient::updateLocationAsync(const char* deviceId, const char* name,
+                                       T latitude, T longitude, T elevation) {
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  _payload_print.reset();
+  printUpdateLocationPayload(&_payload_print, deviceId, name,
                              latitude, longitude, elevation);
-  return readStatusCode();
+  if (!sendStagedPublish()) {
+    printUpdateLocationPayload(&_mmqtt_print, deviceId, name,
+                               latitude, longitude, elevation);
+  }
+  return _current_id;
 }
 
 template <class T>
@@ -651,149 +1543,184 @@ int M2XMQTTClient::printUpdateLocationPayload(Print* print,
                                               const char* deviceId, const char* name,
                                               T latitude, T longitude, T elevation) {
   int bytes = 0;
-  bytes += print->print(F("{\"id\":\""));
-  bytes += print->print(_current_id);
-  bytes += print->print(F("\",\"method\":\"PUT\",\"resource\":\""));
-  if (_path_prefix) { bytes += print->print(_path_prefix); }
-  bytes += print->print(F("/v2/devices/"));
+  bytes += printRequestStart(print, M2X_METHOD_PUT, sizeof(M2X_METHOD_PUT) - 1);
   bytes += print->print(deviceId);
-  bytes += print->print(F("/location"));
-  bytes += print->print(F("\",\"agent\":\""));
-  bytes += print->print(USER_AGENT);
-  bytes += print->print(F("\",\"body\":{\"name\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "/location");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"name\":\"");
   bytes += print->print(name);
-  bytes += print->print(F("\",\"latitude\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "\",\"latitude\":\"");
   bytes += print->print(latitude);
-  bytes += print->print(F("\",\"longitude\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "\",\"longitude\":\"");
   bytes += print->print(longitude);
-  bytes += print->print(F("\",\"elevation\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "\",\"elevation\":\"");
   bytes += print->print(elevation);
-  bytes += print->print(F(("\"}}")));
+  bytes += M2X_PRINT_LITERAL(print, "\"}}");
   return bytes;
 }
 
 int M2XMQTTClient::deleteValues(const char* deviceId, const char* streamName,
                                 const char* from, const char* end) {
-  int length;
-  if (!_connected) {
-    if (connectToServer() != E_OK) {
-      DBGLN("%s", "ERROR: Cannot connect to M2X server!");
-      return E_NOCONNECTION;
-    }
+  return waitForResponse(deleteValuesAsync(deviceId, streamName, from, end));
+}
+
+int M2XMQTTClient::deleteValuesAsync(const char* deviceId, const char* streamName,
+                                     const char* from, const char* end) {
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  _payload_print.reset();
+  printDeleteValuesPayload(&_payload_print, deviceId, streamName, from, end);
+  if (!sendStagedPublish()) {
+    printDeleteValuesPayload(&_mmqtt_print, deviceId, streamName, from, end);
   }
-  _current_id++;
-  length = printDeleteValuesPayload(&_null_print, deviceId, streamName, from, end);
-  mmqtt_s_encode_fixed_header(&_connection, m2x_mmqtt_puller,
-                              MMQTT_PACK_MESSAGE_TYPE(MMQTT_MESSAGE_TYPE_PUBLISH),
-                              length + _key_length + 15);
-  mmqtt_s_encode_uint16(&_connection, m2x_mmqtt_puller, _key_length + 13);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("m2x/"), 4);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) _key, _key_length);
-  mmqtt_s_encode_buffer(&_connection, m2x_mmqtt_puller, (const uint8_t *) F("/requests"), 9);
-  printDeleteValuesPayload(&_mmqtt_print, deviceId, streamName, from, end);
-  return readStatusCode();
+  return _current_id;
 }
 
 int M2XMQTTClient::printDeleteValuesPayload(Print *print,
                                             const char* deviceId, const char* streamName,
                                             const char* from, const char* end) {
   int bytes = 0;
-  bytes += print->print(F("{\"id\":\""));
-  bytes += print->print(_current_id);
-  bytes += print->print(F("\",\"method\":\"DELETE\",\"resource\":\""));
-  if (_path_prefix) { bytes += print->print(_path_prefix); }
-  bytes += print->print(F("/v2/devices/"));
+  bytes += printRequestStart(print, M2X_METHOD_DELETE, sizeof(M2X_METHOD_DELETE) - 1);
   bytes += print->print(deviceId);
-  bytes += print->print(F("/streams/"));
+  bytes += M2X_PRINT_LITERAL(print, "/streams/");
   bytes += print->print(streamName);
-  bytes += print->print(F("/values"));
-  bytes += print->print(F("\",\"agent\":\""));
-  bytes += print->print(USER_AGENT);
-  bytes += print->print(F("\",\"body\":{\"from\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "/values");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"from\":\"");
   bytes += print->print(from);
-  bytes += print->print(F("\",\"end\":\""));
+  bytes += M2X_PRINT_LITERAL(print, "\",\"end\":\"");
   bytes += print->print(end);
-  bytes += print->print(F(("\"}}")));
+  bytes += M2X_PRINT_LITERAL(print, "\"}}");
   return bytes;
 }
 
-int M2XMQTTClient::readStatusCode() {
-  mmqtt_status_t status;
-  uint32_t packet_length;
-  uint8_t flag;
-  int16_t parsed_id, response_status;
-  struct mjson_ctx ctx;
-  char buf[6];
-  size_t buf_length;
-
-  while (true) {
-    status = mmqtt_s_decode_fixed_header(&_connection, m2x_mmqtt_pusher,
-                                         &flag, &packet_length);
-    if (status != MMQTT_STATUS_OK) {
-      DBG("%s", F("Error decoding publish fixed header: "));
-      DBGLN("%d", status);
-      close();
-      return E_DISCONNECTED;
-    }
-    if (MMQTT_UNPACK_MESSAGE_TYPE(flag) != MMQTT_MESSAGE_TYPE_PUBLISH) {
-      status = mmqtt_s_skip_buffer(&_connection, m2x_mmqtt_pusher, packet_length);
-      if (status != MMQTT_STATUS_OK) {
-        DBG("%s", F("Error skipping non-publish packet: "));
-        DBGLN("%d", status);
-        close();
-        return E_DISCONNECTED;
-      }
-    } else {
-      /*
-       * Since we only subscribe to one channel, there's no need to check channel name.
-       */
-      status = mmqtt_s_decode_string(&_connection, m2x_mmqtt_pusher, NULL, 0,
-                                     NULL, NULL);
-      if (status != MMQTT_STATUS_OK) {
-        DBG("%s", F("Error skipping channel name string: "));
-        DBGLN("%d", status);
-        close();
-        return E_DISCONNECTED;
-      }
-      /*
-       * Parse JSON body for ID and status
-       */
-      mjson_init(&ctx, &_connection, m2x_mjson_reader);
-      parsed_id = -1;
-      if (mjson_readcheck_object_start(&ctx) != MJSON_OK) {
-        /* Oops we have an error */
-        DBG("%s", F("Publish Packet is not a JSON object!"));
-        close();
-        return E_DISCONNECTED;
-      }
-      while (mjson_read_object_separator_or_end(&ctx) != MJSON_SUBTYPE_OBJECT_END) {
-        if (mjson_readcheck_string_start(&ctx) != MJSON_OK) {
-          DBG("%s", F("Object key is not string!"));
-          close();
-          return E_DISCONNECTED;
-        }
-        mjson_read_full_string(&ctx, buf, 6, &buf_length);
-        mjson_read_object_key_separator(&ctx);
-        if (strncmp(buf, F("status"), 6) == 0) {
-          mjson_read_int16(&ctx, &response_status);
-        } else if (strncmp(buf, F("id"), 2) == 0) {
-          /* Hack since we know the ID passed is actually an integer*/
-          mjson_readcheck_string_start(&ctx);
-          mjson_read_int16(&ctx, &parsed_id);
-          mjson_read_string_end(&ctx);
-        } else {
-          mjson_skip_value(&ctx);
-        }
+int M2XMQTTClient::postStats(const char* deviceId, const char* streamName) {
+  return waitForResponse(postStatsAsync(deviceId, streamName));
+}
+
+int M2XMQTTClient::postStatsAsync(const char* deviceId, const char* streamName) {
+  M2XStats stats;
+  int ret = beginRequest();
+  if (ret != E_OK) { return ret; }
+  /* Sending changes the counters, both passes must print the same text */
+  stats = _stats;
+  _payload_print.reset();
+  printStatsPayload(&_payload_print, deviceId, streamName, &stats);
+  if (!sendStagedPublish()) {
+    printStatsPayload(&_mmqtt_print, deviceId, streamName, &stats);
+  }
+  return _current_id;
+}
+
+int M2XMQTTClient::printStatsPayload(Print* print, const char* deviceId,
+                                     const char* streamName, const M2XStats* stats) {
+  M2XJsonStringPrint string_print;
+  int bytes = 0;
+  string_print.print = print;
+  bytes += printRequestStart(print, M2X_METHOD_PUT, sizeof(M2X_METHOD_PUT) - 1);
+  bytes += print->print(deviceId);
+  bytes += M2X_PRINT_LITERAL(print, "/streams/");
+  bytes += print->print(streamName);
+  bytes += M2X_PRINT_LITERAL(print, "/value");
+  bytes += M2X_PRINT_LITERAL(print, M2X_REQUEST_AGENT);
+  bytes += M2X_PRINT_LITERAL(print, "{\"value\":\"");
+  bytes += m2x_print_stats(&string_print, stats);
+  bytes += M2X_PRINT_LITERAL(print, "\"}}");
+  return bytes;
+}
+
+// Feeds the bytes the server has sent into the packet parser, never reading
+// past the end of the current packet. Returns E_OK once a full packet has
+// been parsed. If the rest of the packet hasn't arrived yet, E_NOT_READY is
+// returned unless +wait+ is true, in which case the idle function is called
+// until more data shows up. Pending requests are expired while no data is
+// available, and E_NOT_READY is returned as well if any was, so that
+// waiting callers can look at their slot again.
+int M2XMQTTClient::readPacket(bool wait) {
+  uint8_t buf[M2X_READ_CHUNK_SIZE];
+  size_t length;
+  int available, ret;
+
+  while (_connected) {
+    /* Without +wait+, only data that has already arrived is looked at */
+    available = wait ? _client->available() : _client->availableNow();
+    if (available <= 0) {
+      if (!_client->connected()) { break; }
+      if (!keepAlive()) {
+        DBGLN("%s", F("No PINGRESP from the server, reconnecting!"));
+        _stats.timeouts++;
+        break;
       }
-      if (parsed_id == _current_id) { return response_status; }
+      if (expireRequests() || !wait) { return E_NOT_READY; }
+      if (_idlefunc) { _idlefunc(); }
+      continue;
+    }
+    length = min(min(_parser.wanted(), sizeof(buf)), (size_t) available);
+    ret = _client->read(buf, length);
+    if (ret <= 0) { break; }
+    _stats.bytes_in += ret;
+    ret = _parser.feed(buf, ret);
+    if (ret == M2X_PARSE_DONE) {
+      /* Anything from the server shows the connection is alive */
+      _ping_pending = false;
+      return E_OK;
+    }
+    if (ret == M2X_PARSE_ERROR) {
+      DBGLN("%s", F("Malformed packet received!"));
+      break;
     }
   }
-  return E_NOTREACHABLE;
+  close();
+  return E_DISCONNECTED;
+}
+
+// Acts on the packet just parsed, returns true if it completed a request
+bool M2XMQTTClient::handlePacket() {
+  int status;
+
+  if (_handshake) { handleHandshake(); }
+  if (_parser.type() == MMQTT_MESSAGE_TYPE_PUBACK) {
+    ackPublish(_parser.packet_id);
+    return false;
+  }
+  if (_parser.type() != MMQTT_MESSAGE_TYPE_PUBLISH) { return false; }
+  if (_parser.flags & 0x06) { sendPuback(_parser.packet_id); }
+  /* Anything not published on the responses topic is a pushed message */
+  if (strcmp(_parser.message_type, "responses") != 0) {
+    if (!dispatchMessage()) { _stats.unmatched++; }
+    return false;
+  }
+  /* A response also proves the request was delivered */
+  if (_parser.response_id > 0) { ackPublish(_parser.response_id); }
+  if (_parser.response_id > 0 && _parser.response_status == 0) {
+    DBGLN("%s", F("Response has no status code!"));
+    status = E_JSON_INVALID;
+  } else {
+    status = _parser.response_status;
+  }
+  if (!completeRequest(_parser.response_id, status)) {
+    if (!dispatchMessage()) { _stats.unmatched++; }
+    return false;
+  }
+  _stats.responses++;
+  _stats.round_trip_ms.add((unsigned long) (_timer.read_ms64() -
+      _pending[_parser.response_id % M2X_MAX_PENDING_REQUESTS].sent_ms));
+  return true;
 }
 
 void M2XMQTTClient::close() {
   _client->stop();
   _connected = false;
+  /* Losing the connection before the handshake completed counts as a
+   * failed attempt */
+  if (_handshake & M2X_AWAIT_CONNACK) {
+    _stats.connack_failures++;
+  } else if (_handshake) {
+    _stats.suback_failures++;
+  }
+  if (_handshake) { scheduleReconnect(); }
+  _handshake = 0;
+  failPendingRequests(E_DISCONNECTED);
 }
 
 #endif  /* M2XMQTTCLIENT_H_ */
@@ -0,0 +1,379 @@
+#ifndef M2XOFFLINELOG_H_
+#define M2XOFFLINELOG_H_
+
+#include "M2XMQTTClient.h"
+#include "m2x-time.h"
+
+/* Longest stream name that can be logged */
+#ifndef M2X_OFFLINE_NAME_SIZE
+#define M2X_OFFLINE_NAME_SIZE 32
+#endif
+
+/*
+ * Storage backends for M2XOfflineLog
+ *
+ * A backend is a fixed size byte array the log uses as a ring, plus a place
+ * to keep the position of the ring. Offsets passed to read() and write()
+ * never cross the end of the array.
+ */
+
+// Keeps the log in RAM, it is lost on reset
+template <uint32_t SIZE>
+class M2XRamStorage {
+public:
+  uint32_t capacity() const { return SIZE; }
+
+  void read(uint32_t offset, uint8_t* buf, size_t length) {
+    memcpy(buf, _data + offset, length);
+  }
+
+  void write(uint32_t offset, const uint8_t* buf, size_t length) {
+    memcpy(_data + offset, buf, length);
+  }
+
+  void load(uint32_t* head, uint32_t* used) { *head = *used = 0; }
+  void save(uint32_t, uint32_t) {}
+private:
+  uint8_t _data[SIZE];
+};
+
+#ifdef LINUX_PLATFORM
+// Keeps the log in a file of fixed size, so logged values survive a restart
+// of the program. The ring position is stored in a 16 byte header, a file
+// created with a different capacity is started over.
+class M2XFileStorage {
+public:
+  M2XFileStorage(const char* path, uint32_t capacity);
+  ~M2XFileStorage();
+
+  // False if the file could not be opened
+  bool ok() const { return _fd != -1; }
+
+  uint32_t capacity() const { return _capacity; }
+  void read(uint32_t offset, uint8_t* buf, size_t length);
+  void write(uint32_t offset, const uint8_t* buf, size_t length);
+  void load(uint32_t* head, uint32_t* used);
+  void save(uint32_t head, uint32_t used);
+private:
+  int _fd;
+  uint32_t _capacity;
+};
+
+M2XFileStorage::M2XFileStorage(const char* path, uint32_t capacity) : _capacity(capacity) {
+  _fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (_fd != -1 && ftruncate(_fd, 16 + capacity) != 0) {
+    ::close(_fd);
+    _fd = -1;
+  }
+}
+
+M2XFileStorage::~M2XFileStorage() {
+  if (_fd != -1) { ::close(_fd); }
+}
+
+void M2XFileStorage::read(uint32_t offset, uint8_t* buf, size_t length) {
+  if (pread(_fd, buf, length, 16 + offset) != (ssize_t) length) {
+    memset(buf, 0, length);
+  }
+}
+
+void M2XFileStorage::write(uint32_t offset, const uint8_t* buf, size_t length) {
+  if (pwrite(_fd, buf, length, 16 + offset) != (ssize_t) length) {
+    DBGLN("%s", F("Error writing offline log!"));
+  }
+}
+
+void M2XFileStorage::load(uint32_t* head, uint32_t* used) {
+  uint32_t header[4];
+
+  *head = *used = 0;
+  if (pread(_fd, header, sizeof(header), 0) == sizeof(header) &&
+      memcmp(&header[0], "M2XL", 4) == 0 && header[1] == _capacity &&
+      header[2] < _capacity && header[3] <= _capacity) {
+    *head = header[2];
+    *used = header[3];
+  }
+}
+
+void M2XFileStorage::save(uint32_t head, uint32_t used) {
+  uint32_t header[4];
+
+  memcpy(&header[0], "M2XL", 4);
+  header[1] = _capacity;
+  header[2] = head;
+  header[3] = used;
+  if (pwrite(_fd, header, sizeof(header), 0) != sizeof(header)) {
+    DBGLN("%s", F("Error writing offline log header!"));
+  }
+}
+#endif  /* LINUX_PLATFORM */
+
+// Store-and-forward log of stream values for links that come and go.
+//
+// add() sends a value right away while the server is reachable. Once a
+// request fails because the connection is down, values are appended to the
+// log instead, and later calls to add() or poll() try to send the logged
+// values again at most every +retry_ms+. The log is drained oldest first
+// as postDeviceUpdates requests of up to +MAX_VALUES+ values spread over
+// at most +MAX_STREAMS+ streams.
+//
+// Values are logged as compact binary records, not as JSON: the stream
+// name, the timestamp in milliseconds since the epoch and the value as a
+// double, 17 bytes plus the name. When the log is full, the oldest records
+// are dropped to make room.
+template <class Storage, int MAX_VALUES = 16, int MAX_STREAMS = 4>
+class M2XOfflineLog {
+public:
+  M2XOfflineLog(M2XMQTTClient* client,
+                const char* deviceId,
+                Storage* storage,
+                unsigned long retry_ms = 10000);
+
+  // Sends +value+ for stream +streamName+ taken at +at+, an ISO 8601
+  // timestamp, or logs it if the server can't be reached right now.
+  // Returns the status code of the request, E_OK if the value was logged,
+  // E_TIMESTAMP_ERROR if +at+ can't be parsed or E_INVALID if the stream
+  // name is longer than M2X_OFFLINE_NAME_SIZE.
+  int add(const char* streamName, const char* at, double value);
+
+  // Appends a value to the log without trying to send anything
+  int append(const char* streamName, const char* at, double value);
+
+  // Tries to drain the log if the retry interval has passed since the
+  // last failure. Returns E_OK or the status code of the failed request.
+  int poll();
+
+  // Sends logged values until the log is empty or a request fails because
+  // the connection is down, whose status code is then returned.
+  int drain();
+
+  bool empty() const { return _used == 0; }
+  // Bytes taken by the logged records
+  uint32_t used() const { return _used; }
+  // Number of records dropped because the log was full
+  unsigned long dropped() const { return _dropped; }
+
+private:
+  struct Entry {
+    uint8_t stream;
+    int64_t at;
+    double value;
+  };
+
+  M2XMQTTClient* _client;
+  const char* _deviceId;
+  Storage* _storage;
+  uint32_t _capacity;
+  uint32_t _head;
+  uint32_t _used;
+  unsigned long _dropped;
+  unsigned long _retry_ms;
+  uint64_t _failed_ms;
+  bool _offline;
+  M2XTimer _timer;
+
+  /* Batch being drained */
+  Entry _entries[MAX_VALUES];
+  char _names[MAX_STREAMS][M2X_OFFLINE_NAME_SIZE + 1];
+  const char* _name_list[MAX_STREAMS];
+  int _counts[MAX_STREAMS];
+  int64_t _ats[MAX_VALUES];
+  double _values[MAX_VALUES];
+
+  void readRing(uint32_t offset, uint8_t* buf, size_t length);
+  void writeRing(uint32_t offset, const uint8_t* buf, size_t length);
+  int sendBatch();
+};
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::M2XOfflineLog(M2XMQTTClient* client,
+                                                               const char* deviceId,
+                                                               Storage* storage,
+                                                               unsigned long retry_ms) :
+    _client(client),
+    _deviceId(deviceId),
+    _storage(storage),
+    _capacity(storage->capacity()),
+    _dropped(0),
+    _retry_ms(retry_ms),
+    _failed_ms(0),
+    _offline(false) {
+  _storage->load(&_head, &_used);
+  _timer.start();
+}
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+void M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::readRing(uint32_t offset,
+                                                               uint8_t* buf, size_t length) {
+  size_t first;
+
+  offset %= _capacity;
+  first = MIN(length, (size_t) (_capacity - offset));
+  _storage->read(offset, buf, first);
+  if (first < length) { _storage->read(0, buf + first, length - first); }
+}
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+void M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::writeRing(uint32_t offset,
+                                                                const uint8_t* buf, size_t length) {
+  size_t first;
+
+  offset %= _capacity;
+  first = MIN(length, (size_t) (_capacity - offset));
+  _storage->write(offset, buf, first);
+  if (first < length) { _storage->write(0, buf + first, length - first); }
+}
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+int M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::add(const char* streamName,
+                                                         const char* at, double value) {
+  int64_t ms;
+  int status;
+
+  if (_offline || _used > 0) {
+    /* Keep values in order behind the ones already logged */
+    status = append(streamName, at, value);
+    if (status != E_OK) { return status; }
+    status = poll();
+    return (status == E_NOCONNECTION || status == E_DISCONNECTED) ? E_OK : status;
+  }
+  if (strlen(streamName) > M2X_OFFLINE_NAME_SIZE) { return E_INVALID; }
+  if (!m2x_parse_iso8601(at, &ms)) { return E_TIMESTAMP_ERROR; }
+  const int count = 1;
+  status = _client->postDeviceUpdates(_deviceId, 1, &streamName, &count, &at, &value);
+  if (status == E_NOCONNECTION || status == E_DISCONNECTED) {
+    _offline = true;
+    _failed_ms = _timer.read_ms64();
+    return append(streamName, at, value);
+  }
+  return status;
+}
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+int M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::append(const char* streamName,
+                                                            const char* at, double value) {
+  uint8_t record[1 + M2X_OFFLINE_NAME_SIZE + 16];
+  size_t name_length = strlen(streamName), length, i;
+  uint8_t dropped_length;
+  int64_t ms;
+
+  if (name_length > M2X_OFFLINE_NAME_SIZE) { return E_INVALID; }
+  if (!m2x_parse_iso8601(at, &ms)) { return E_TIMESTAMP_ERROR; }
+  length = 1 + name_length + 16;
+  if (length > _capacity) { return E_BUFFER_TOO_SMALL; }
+
+  /* Make room by dropping the oldest records */
+  while (_capacity - _used < length) {
+    readRing(_head, &dropped_length, 1);
+    _head = (_head + 1 + dropped_length + 16) % _capacity;
+    _used -= 1 + dropped_length + 16;
+    _dropped++;
+  }
+
+  record[0] = (uint8_t) name_length;
+  memcpy(record + 1, streamName, name_length);
+  for (i = 0; i < 8; i++) {
+    record[1 + name_length + i] = (uint8_t) ((uint64_t) ms >> (8 * i));
+  }
+  memcpy(record + 1 + name_length + 8, &value, 8);
+  writeRing(_head + _used, record, length);
+  _used += length;
+  _storage->save(_head, _used);
+  return E_OK;
+}
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+int M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::poll() {
+  if (_used == 0 ||
+      (_offline && _timer.read_ms64() - _failed_ms < _retry_ms)) {
+    return E_OK;
+  }
+  return drain();
+}
+
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+int M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::drain() {
+  int status;
+
+  while (_used > 0) {
+    status = sendBatch();
+    if (status == E_NOCONNECTION || status == E_DISCONNECTED) {
+      _offline = true;
+      _failed_ms = _timer.read_ms64();
+      return status;
+    }
+  }
+  _offline = false;
+  return E_OK;
+}
+
+// Sends the oldest logged records in one request and drops them from the
+// log unless the connection was down
+template <class Storage, int MAX_VALUES, int MAX_STREAMS>
+int M2XOfflineLog<Storage, MAX_VALUES, MAX_STREAMS>::sendBatch() {
+  uint8_t record[1 + M2X_OFFLINE_NAME_SIZE + 16];
+  uint32_t consumed = 0;
+  uint64_t ms;
+  int count = 0, stream_num = 0, stream, offsets[MAX_STREAMS], i, status;
+  size_t name_length;
+
+  while (consumed < _used && count < MAX_VALUES) {
+    readRing(_head + consumed, record, 1);
+    name_length = record[0];
+    if (name_length > M2X_OFFLINE_NAME_SIZE ||
+        1 + name_length + 16 > _used - consumed) {
+      /* The log is corrupted, there's no telling where records start */
+      DBGLN("%s", F("Offline log is corrupted, dropping it!"));
+      _head = _used = 0;
+      _storage->save(_head, _used);
+      return E_OK;
+    }
+    readRing(_head + consumed + 1, record + 1, name_length + 16);
+    for (stream = 0; stream < stream_num; stream++) {
+      if (strlen(_names[stream]) == name_length &&
+          memcmp(_names[stream], record + 1, name_length) == 0) {
+        break;
+      }
+    }
+    if (stream == stream_num) {
+      if (stream_num == MAX_STREAMS) { break; }
+      memcpy(_names[stream], record + 1, name_length);
+      _names[stream][name_length] = '\0';
+      _name_list[stream] = _names[stream];
+      _counts[stream] = 0;
+      stream_num++;
+    }
+    ms = 0;
+    for (i = 7; i >= 0; i--) {
+      ms = (ms << 8) | record[1 + name_length + i];
+    }
+    _entries[count].stream = (uint8_t) stream;
+    _entries[count].at = (int64_t) ms;
+    memcpy(&_entries[count].value, record + 1 + name_length + 8, 8);
+    _counts[stream]++;
+    count++;
+    consumed += 1 + name_length + 16;
+  }
+
+  /* Group values by stream, keeping them in the order they were logged */
+  offsets[0] = 0;
+  for (i = 1; i < stream_num; i++) {
+    offsets[i] = offsets[i - 1] + _counts[i - 1];
+  }
+  for (i = 0; i < count; i++) {
+    int index = offsets[_entries[i].stream]++;
+    _ats[index] = _entries[i].at;
+    _values[index] = _entries[i].value;
+  }
+  status = _client->postDeviceUpdates(_deviceId, stream_num, _name_list, _counts,
+                                      _ats, _values);
+  if (status == E_NOCONNECTION || status == E_DISCONNECTED) {
+    return status;
+  }
+  _head = (_head + consumed) % _capacity;
+  _used -= consumed;
+  _storage->save(_head, _used);
+  return status;
+}
+
+#endif  /* M2XOFFLINELOG_H_ */
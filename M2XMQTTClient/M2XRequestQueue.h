@@ -0,0 +1,193 @@
+#ifndef M2XREQUESTQUEUE_H_
+#define M2XREQUESTQUEUE_H_
+
+#include "M2XMQTTClient.h"
+#include "m2x-time.h"
+
+/* Longest stream name that can be queued */
+#ifndef M2X_QUEUE_NAME_SIZE
+#define M2X_QUEUE_NAME_SIZE 32
+#endif
+
+// A stream value waiting in an M2XRequestQueue
+struct M2XQueuedValue {
+  const char* deviceId;
+  char streamName[M2X_QUEUE_NAME_SIZE + 1];
+  bool timestamped;
+  int64_t at;
+  double value;
+};
+
+// Lock-free queue handing stream values from any number of producer
+// threads to the one thread that owns the M2XMQTTClient.
+//
+// M2XMQTTClient is not thread safe and each request holds on to the
+// connection until it is written. Instead of sharing the client behind a
+// mutex, sensor threads push() compact records here, which never blocks and
+// never touches the network, and the network thread calls drain() to turn
+// them into requests. Responses are delivered to the client's response
+// callback when the network thread calls poll().
+//
+// The queue is a bounded ring of +CAPACITY+ slots, which must be a power of
+// two. Each slot carries a sequence number telling whether it is free or
+// holds a record for the consumer (see Dmitry Vyukov's bounded MPMC queue),
+// so producers only race on the position counter, claimed with one
+// compare-and-swap. push() fails instead of waiting when the queue is full.
+//
+// NOTE: device IDs are not copied, the strings passed to push() must stay
+// valid until the values are drained. Stream names are copied.
+template <int CAPACITY = 16>
+class M2XRequestQueue {
+public:
+  M2XRequestQueue();
+
+  // Queues +value+ for stream +streamName+, sent as an updateStreamValue
+  // request. Safe to call from any thread. Returns E_OK,
+  // E_BUFFER_TOO_SMALL if the queue is full or E_INVALID if the stream
+  // name is longer than M2X_QUEUE_NAME_SIZE.
+  int push(const char* deviceId, const char* streamName, double value);
+
+  // Same, with the time the value was taken in milliseconds since the
+  // epoch. Sent as a postDeviceUpdate request.
+  int push(const char* deviceId, const char* streamName, double value, int64_t at);
+
+  // Submits up to +max+ queued values as asynchronous requests, in the
+  // order they were pushed. Only the thread owning +client+ may call this.
+  // Returns the number of requests submitted, or the status code of the
+  // first request that failed because the connection is down, in which
+  // case its value is kept for the next call. On a client with
+  // non-blocking requests, draining stops at the first request that finds
+  // no free request slot, keeping its value as well.
+  int drain(M2XMQTTClient* client, int max = CAPACITY);
+
+  // Oldest queued value, or NULL if the queue is empty. Consumer side
+  // only, the value stays queued until pop() is called.
+  const M2XQueuedValue* front();
+  void pop();
+
+  // Number of values rejected because the queue was full
+  unsigned long dropped() const { return _dropped; }
+
+private:
+  typedef char capacity_must_be_a_power_of_two[(CAPACITY & (CAPACITY - 1)) == 0 ? 1 : -1];
+
+  struct Cell {
+    volatile uint32_t sequence;
+    M2XQueuedValue value;
+  };
+
+  Cell _cells[CAPACITY];
+  volatile uint32_t _enqueue_pos;
+  uint32_t _dequeue_pos;
+  volatile uint32_t _dropped;
+
+  int pushValue(const char* deviceId, const char* streamName,
+                bool timestamped, int64_t at, double value);
+};
+
+template <int CAPACITY>
+M2XRequestQueue<CAPACITY>::M2XRequestQueue() : _enqueue_pos(0),
+                                               _dequeue_pos(0),
+                                               _dropped(0) {
+  for (int i = 0; i < CAPACITY; i++) { _cells[i].sequence = i; }
+}
+
+template <int CAPACITY>
+int M2XRequestQueue<CAPACITY>::push(const char* deviceId, const char* streamName,
+                                    double value) {
+  return pushValue(deviceId, streamName, false, 0, value);
+}
+
+template <int CAPACITY>
+int M2XRequestQueue<CAPACITY>::push(const char* deviceId, const char* streamName,
+                                    double value, int64_t at) {
+  return pushValue(deviceId, streamName, true, at, value);
+}
+
+template <int CAPACITY>
+int M2XRequestQueue<CAPACITY>::pushValue(const char* deviceId, const char* streamName,
+                                         bool timestamped, int64_t at, double value) {
+  size_t name_length = strlen(streamName);
+  uint32_t pos, dropped;
+  int32_t diff;
+  Cell* cell;
+
+  if (name_length > M2X_QUEUE_NAME_SIZE) { return E_INVALID; }
+  pos = _enqueue_pos;
+  while (true) {
+    cell = &_cells[pos & (CAPACITY - 1)];
+    diff = (int32_t) (cell->sequence - pos);
+    if (diff == 0) {
+      /* The slot is free, claim it unless another producer got there first */
+      if (m2x_atomic_cas(&_enqueue_pos, pos, pos + 1)) { break; }
+      pos = _enqueue_pos;
+    } else if (diff < 0) {
+      /* The consumer hasn't freed the slot a full lap ago, queue is full */
+      do {
+        dropped = _dropped;
+      } while (!m2x_atomic_cas(&_dropped, dropped, dropped + 1));
+      return E_BUFFER_TOO_SMALL;
+    } else {
+      /* Another producer claimed this position, catch up */
+      pos = _enqueue_pos;
+    }
+  }
+  cell->value.deviceId = deviceId;
+  memcpy(cell->value.streamName, streamName, name_length + 1);
+  cell->value.timestamped = timestamped;
+  cell->value.at = at;
+  cell->value.value = value;
+  /* Publish the record before handing the slot to the consumer */
+  m2x_memory_barrier();
+  cell->sequence = pos + 1;
+  return E_OK;
+}
+
+template <int CAPACITY>
+const M2XQueuedValue* M2XRequestQueue<CAPACITY>::front() {
+  Cell* cell = &_cells[_dequeue_pos & (CAPACITY - 1)];
+
+  if (cell->sequence != _dequeue_pos + 1) { return NULL; }
+  /* Don't read the record before seeing its sequence number */
+  m2x_memory_barrier();
+  return &cell->value;
+}
+
+template <int CAPACITY>
+void M2XRequestQueue<CAPACITY>::pop() {
+  Cell* cell = &_cells[_dequeue_pos & (CAPACITY - 1)];
+
+  /* Done reading the record before producers may reuse the slot */
+  m2x_memory_barrier();
+  cell->sequence = _dequeue_pos + CAPACITY;
+  _dequeue_pos++;
+}
+
+template <int CAPACITY>
+int M2XRequestQueue<CAPACITY>::drain(M2XMQTTClient* client, int max) {
+  char at[M2X_ISO8601_LENGTH + 1];
+  const M2XQueuedValue* record;
+  const char* name;
+  int count = 0, status;
+
+  while (count < max && (record = front()) != NULL) {
+    if (record->timestamped) {
+      m2x_format_iso8601(at, record->at);
+      name = record->streamName;
+      status = client->postDeviceUpdateAsync(record->deviceId, 1, &name,
+                                             &record->value, at);
+    } else {
+      status = client->updateStreamValueAsync(record->deviceId, record->streamName,
+                                              record->value);
+    }
+    if (status == E_NOCONNECTION || status == E_DISCONNECTED) { return status; }
+    /* No free request slot on a non-blocking client, try again later */
+    if (status == E_NOT_READY) { break; }
+    /* Other errors come from the record itself, retrying won't help */
+    pop();
+    if (status >= 0) { count++; }
+  }
+  return count;
+}
+
+#endif  /* M2XREQUESTQUEUE_H_ */
@@ -0,0 +1,178 @@
+#ifndef M2XSTREAMFILTER_H_
+#define M2XSTREAMFILTER_H_
+
+#include <math.h>
+
+#include "M2XMQTTClient.h"
+
+// Drops stream values that don't differ enough from the last value sent,
+// before anything is rendered or sent.
+//
+// A value is redundant when it is within the deadband of the last value
+// sent for its stream: at most +absolute+ away from it, or at most
+// +relative+ times its magnitude away. With both set to 0, only exact
+// repeats are dropped, which suits state streams like doors or switches.
+// When +heartbeat_ms+ is not 0, a value is sent anyway once that much time
+// has passed since the last one, so the server still sees a stream whose
+// value doesn't change.
+//
+// The last value of up to +MAX_STREAMS+ streams is kept in a fixed size
+// table. Streams are added on first use with the default deadband given to
+// the constructor, or configured ahead with setDeadband(). Values of
+// streams that don't fit in the table are never dropped.
+//
+// NOTE: stream names are not copied, the strings passed in must stay valid
+// for as long as the filter is used.
+template <int MAX_STREAMS = 8>
+class M2XStreamFilter {
+public:
+  M2XStreamFilter(M2XMQTTClient* client,
+                  const char* deviceId,
+                  double absolute = 0,
+                  double relative = 0,
+                  unsigned long heartbeat_ms = 0);
+
+  // Sets the deadband of stream +streamName+. Returns E_OK, or
+  // E_BUFFER_TOO_SMALL if the table is full.
+  int setDeadband(const char* streamName, double absolute, double relative = 0);
+
+  // Sends +value+ with updateStreamValue unless it is redundant. Returns
+  // the status code of the request, or E_OK if the value was dropped.
+  template <class T>
+  int updateStreamValue(const char* streamName, T value);
+
+  // Same with updateStreamValueAsync, returns the request ID or E_OK if
+  // the value was dropped
+  template <class T>
+  int updateStreamValueAsync(const char* streamName, T value);
+
+  // Filter stage for use in front of any other API: returns false if
+  // +value+ is redundant, otherwise records it as the last value sent and
+  // returns true. Call forget() if sending it then fails.
+  bool accept(const char* streamName, double value);
+
+  // Clears the last value of +streamName+, so its next value is sent
+  void forget(const char* streamName);
+
+  // Number of values dropped so far
+  unsigned long filtered() const { return _filtered; }
+
+private:
+  struct Entry {
+    const char* name;
+    double absolute;
+    double relative;
+    double last;
+    uint64_t last_ms;
+    bool has_last;
+  };
+
+  M2XMQTTClient* _client;
+  const char* _deviceId;
+  double _absolute;
+  double _relative;
+  unsigned long _heartbeat_ms;
+  unsigned long _filtered;
+  Entry _entries[MAX_STREAMS];
+  int _count;
+  M2XTimer _timer;
+
+  Entry* find(const char* streamName, bool add);
+};
+
+template <int MAX_STREAMS>
+M2XStreamFilter<MAX_STREAMS>::M2XStreamFilter(M2XMQTTClient* client,
+                                              const char* deviceId,
+                                              double absolute,
+                                              double relative,
+                                              unsigned long heartbeat_ms) :
+    _client(client),
+    _deviceId(deviceId),
+    _absolute(absolute),
+    _relative(relative),
+    _heartbeat_ms(heartbeat_ms),
+    _filtered(0),
+    _count(0) {
+  _timer.start();
+}
+
+template <int MAX_STREAMS>
+typename M2XStreamFilter<MAX_STREAMS>::Entry*
+M2XStreamFilter<MAX_STREAMS>::find(const char* streamName, bool add) {
+  Entry* entry;
+
+  for (int i = 0; i < _count; i++) {
+    if (_entries[i].name == streamName || strcmp(_entries[i].name, streamName) == 0) {
+      return &_entries[i];
+    }
+  }
+  if (!add || _count == MAX_STREAMS) { return NULL; }
+  entry = &_entries[_count++];
+  entry->name = streamName;
+  entry->absolute = _absolute;
+  entry->relative = _relative;
+  entry->has_last = false;
+  return entry;
+}
+
+template <int MAX_STREAMS>
+int M2XStreamFilter<MAX_STREAMS>::setDeadband(const char* streamName,
+                                              double absolute, double relative) {
+  Entry* entry = find(streamName, true);
+
+  if (entry == NULL) { return E_BUFFER_TOO_SMALL; }
+  entry->absolute = absolute;
+  entry->relative = relative;
+  return E_OK;
+}
+
+template <int MAX_STREAMS>
+bool M2XStreamFilter<MAX_STREAMS>::accept(const char* streamName, double value) {
+  Entry* entry = find(streamName, true);
+  uint64_t now = _timer.read_ms64();
+  double change;
+
+  if (entry == NULL) { return true; }
+  if (entry->has_last &&
+      (_heartbeat_ms == 0 || now - entry->last_ms < _heartbeat_ms)) {
+    change = fabs(value - entry->last);
+    if (change <= entry->absolute || change <= entry->relative * fabs(entry->last)) {
+      _filtered++;
+      return false;
+    }
+  }
+  entry->last = value;
+  entry->last_ms = now;
+  entry->has_last = true;
+  return true;
+}
+
+template <int MAX_STREAMS>
+void M2XStreamFilter<MAX_STREAMS>::forget(const char* streamName) {
+  Entry* entry = find(streamName, false);
+  if (entry != NULL) { entry->has_last = false; }
+}
+
+template <int MAX_STREAMS>
+template <class T>
+int M2XStreamFilter<MAX_STREAMS>::updateStreamValue(const char* streamName, T value) {
+  int status;
+
+  if (!accept(streamName, (double) value)) { return E_OK; }
+  status = _client->updateStreamValue(_deviceId, streamName, value);
+  if (!m2x_status_is_success(status)) { forget(streamName); }
+  return status;
+}
+
+template <int MAX_STREAMS>
+template <class T>
+int M2XStreamFilter<MAX_STREAMS>::updateStreamValueAsync(const char* streamName, T value) {
+  int id;
+
+  if (!accept(streamName, (double) value)) { return E_OK; }
+  id = _client->updateStreamValueAsync(_deviceId, streamName, value);
+  if (id < 0) { forget(streamName); }
+  return id;
+}
+
+#endif  /* M2XSTREAMFILTER_H_ */
@@ -0,0 +1,182 @@
+#ifndef M2XUPDATEBATCHER_H_
+#define M2XUPDATEBATCHER_H_
+
+#include "M2XMQTTClient.h"
+
+/* Room for "yyyy-mm-ddTHH:MM:SS.SSSZ" plus the terminating NUL */
+#define M2X_TIMESTAMP_BUFFER_SIZE 25
+
+// Coalesces single stream values of one device into batched postDeviceUpdates
+// requests, so many readings share one PUBLISH, one JSON envelope and one
+// round trip.
+//
+// All storage is static: up to +MAX_VALUES+ values spread over at most
+// +MAX_STREAMS+ streams are buffered. The buffered values are flushed when
+// any of the following happens:
+//   * the number of buffered values reaches +max_count+
+//   * the approximate serialized size of the buffered values reaches
+//     +max_bytes+ (0 disables this check)
+//   * the oldest buffered value is +max_age_ms+ old (0 disables this check),
+//     which is checked on each add() and poll() call
+//
+// NOTE: stream names are not copied, so the strings passed to add() must
+// stay valid until the values are flushed. Timestamps are copied.
+template <class T, int MAX_VALUES, int MAX_STREAMS = 8>
+class M2XUpdateBatcher {
+public:
+  M2XUpdateBatcher(M2XMQTTClient* client,
+                   const char* deviceId,
+                   int max_count = MAX_VALUES,
+                   int max_bytes = 0,
+                   unsigned long max_age_ms = 0);
+
+  // Buffers +value+ for stream +streamName+ taken at +at+, an ISO 8601
+  // timestamp. Returns E_OK if the value was only buffered, otherwise the
+  // status code of the flush it triggered. E_INVALID is returned if the
+  // timestamp is too long or no stream slot is left even after flushing,
+  // E_BUFFER_TOO_SMALL if MAX_VALUES values are still buffered because
+  // earlier flushes could not be delivered.
+  int add(const char* streamName, const char* at, T value);
+
+  // Flushes the buffered values if the age deadline has passed. Returns
+  // E_OK if nothing had to be sent, otherwise the status code of the flush.
+  int poll();
+
+  // Sends all buffered values in a single postDeviceUpdates request and
+  // returns its status code. Values are kept if the request could not be
+  // delivered (E_NOCONNECTION or E_DISCONNECTED) so a later flush can
+  // retry, otherwise they are dropped.
+  int flush();
+
+  // Number of values currently buffered
+  int size() const { return _count; }
+
+private:
+  M2XMQTTClient* _client;
+  const char* _deviceId;
+  int _max_count;
+  int _max_bytes;
+  unsigned long _max_age_ms;
+  M2XTimer _timer;
+  uint64_t _first_ms;
+  int _bytes;
+
+  int _count;
+  const char* _names[MAX_STREAMS];
+  int _counts[MAX_STREAMS];
+  int _stream_num;
+
+  /* Values are kept grouped by stream, in the order they were added, so
+   * they can be handed to postDeviceUpdates as they are. Timestamps are
+   * copied into the slot of the order they arrived in. */
+  const char* _ats[MAX_VALUES];
+  T _values[MAX_VALUES];
+  char _at_buffers[MAX_VALUES][M2X_TIMESTAMP_BUFFER_SIZE];
+
+  int findStream(const char* streamName);
+};
+
+template <class T, int MAX_VALUES, int MAX_STREAMS>
+M2XUpdateBatcher<T, MAX_VALUES, MAX_STREAMS>::M2XUpdateBatcher(M2XMQTTClient* client,
+                                                               const char* deviceId,
+                                                               int max_count,
+                                                               int max_bytes,
+                                                               unsigned long max_age_ms) :
+    _client(client),
+    _deviceId(deviceId),
+    _max_count(MIN(max_count, MAX_VALUES)),
+    _max_bytes(max_bytes),
+    _max_age_ms(max_age_ms),
+    _first_ms(0),
+    _bytes(0),
+    _count(0),
+    _stream_num(0) {
+  _timer.start();
+}
+
+template <class T, int MAX_VALUES, int MAX_STREAMS>
+int M2XUpdateBatcher<T, MAX_VALUES, MAX_STREAMS>::findStream(const char* streamName) {
+  for (int i = 0; i < _stream_num; i++) {
+    if (_names[i] == streamName || strcmp(_names[i], streamName) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+template <class T, int MAX_VALUES, int MAX_STREAMS>
+int M2XUpdateBatcher<T, MAX_VALUES, MAX_STREAMS>::add(const char* streamName,
+                                                      const char* at, T value) {
+  NullPrint null_print;
+  size_t at_length = strlen(at);
+  int stream, status, index, i;
+
+  if (at_length >= M2X_TIMESTAMP_BUFFER_SIZE) { return E_INVALID; }
+  if (_count == MAX_VALUES) {
+    /* Values kept by failed flushes fill the buffer, try sending them */
+    flush();
+    if (_count == MAX_VALUES) { return E_BUFFER_TOO_SMALL; }
+  }
+  stream = findStream(streamName);
+  if (stream < 0 && _stream_num == MAX_STREAMS) {
+    /* Out of stream slots, make room by sending what we have */
+    status = flush();
+    if (_count > 0) { return status; }
+  }
+  if (stream < 0) {
+    if (_stream_num == MAX_STREAMS) { return E_INVALID; }
+    stream = _stream_num++;
+    _names[stream] = streamName;
+    _counts[stream] = 0;
+    /* "name":[], */
+    _bytes += strlen(streamName) + 6;
+  }
+  if (_count == 0) { _first_ms = _timer.read_ms64(); }
+
+  /* Goes after the last value of its stream, later streams move up */
+  index = 0;
+  for (i = 0; i <= stream; i++) { index += _counts[i]; }
+  for (i = _count; i > index; i--) {
+    _ats[i] = _ats[i - 1];
+    _values[i] = _values[i - 1];
+  }
+  memcpy(_at_buffers[_count], at, at_length + 1);
+  _ats[index] = _at_buffers[_count];
+  _values[index] = value;
+  _count++;
+  _counts[stream]++;
+  /* {"timestamp": "<at>","value": "<value>"}, */
+  _bytes += at_length + null_print.print(value) + 30;
+
+  if (_count >= _max_count || (_max_bytes > 0 && _bytes >= _max_bytes)) {
+    return flush();
+  }
+  return poll();
+}
+
+template <class T, int MAX_VALUES, int MAX_STREAMS>
+int M2XUpdateBatcher<T, MAX_VALUES, MAX_STREAMS>::poll() {
+  if (_count > 0 && _max_age_ms > 0 &&
+      _timer.read_ms64() - _first_ms >= _max_age_ms) {
+    return flush();
+  }
+  return E_OK;
+}
+
+template <class T, int MAX_VALUES, int MAX_STREAMS>
+int M2XUpdateBatcher<T, MAX_VALUES, MAX_STREAMS>::flush() {
+  int status;
+
+  if (_count == 0) { return E_OK; }
+  status = _client->postDeviceUpdates(_deviceId, _stream_num, _names, _counts,
+                                      _ats, _values);
+  if (status == E_NOCONNECTION || status == E_DISCONNECTED) {
+    return status;
+  }
+  _count = 0;
+  _stream_num = 0;
+  _bytes = 0;
+  return status;
+}
+
+#endif  /* M2XUPDATEBATCHER_H_ */
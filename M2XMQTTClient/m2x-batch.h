@@ -0,0 +1,181 @@
+#ifndef M2X_BATCH_H_
+#define M2X_BATCH_H_
+
+/*
+ * Columnar batch of timestamped stream values for postDeviceUpdates
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "m2x-time.h"
+
+/* Value types of a batch stream */
+static const uint8_t M2X_BATCH_INT = 0;
+static const uint8_t M2X_BATCH_FLOAT = 1;
+static const uint8_t M2X_BATCH_DOUBLE = 2;
+
+// One stream of an M2XBatch, its timestamps and values live in two arrays
+// of +capacity+ items carved out of the arena
+struct M2XBatchStream {
+  const char* name;
+  uint16_t name_length;
+  uint8_t type;
+  uint16_t count;
+  uint16_t capacity;
+  int64_t* ats;
+  void* values;
+};
+
+// Values of several streams of one device, stored as one column of
+// timestamps and one column of values per stream.
+//
+// All memory comes from an arena provided by the caller: the stream table
+// for up to +max_streams+ streams, the stream names, copied once along with
+// their length, and the columns, sized when each stream is added. Nothing
+// is ever allocated on the heap, so large backfill batches can be built and
+// sent over and over with the same arena. Timestamps are kept as
+// milliseconds since the epoch and only rendered as ISO 8601 text while
+// the batch is sent with M2XMQTTClient::postDeviceUpdates(deviceId, batch).
+// Each stream has its own value type.
+class M2XBatch {
+public:
+  M2XBatch(void* arena, size_t size, int max_streams = 8);
+
+  // Adds a stream of values of +type+ (one of the M2X_BATCH_* constants)
+  // with room for +capacity+ values. Returns its index, E_BUFFER_TOO_SMALL
+  // if the arena is full or E_INVALID if +type+ or +capacity+ is invalid.
+  int addStream(const char* name, uint8_t type, int capacity);
+
+  // Appends a value taken at +at+, in milliseconds since the epoch, to
+  // stream +stream+. The value is converted to the type of the stream.
+  // Returns E_OK, E_BUFFER_TOO_SMALL if the stream is full or E_INVALID if
+  // there is no such stream.
+  int add(int stream, int64_t at, int value);
+  int add(int stream, int64_t at, long value);
+  int add(int stream, int64_t at, float value);
+  int add(int stream, int64_t at, double value);
+
+  // Drops all values, keeping the streams
+  void clear();
+  // Drops all streams and values
+  void reset();
+
+  int streamCount() const { return _stream_count; }
+  const M2XBatchStream* stream(int index) const { return &_streams[index]; }
+  // Total number of values in the batch
+  int valueCount() const;
+
+private:
+  uint8_t* _arena;
+  size_t _size;
+  size_t _used;
+  M2XBatchStream* _streams;
+  int _max_streams;
+  int _stream_count;
+
+  void* allocate(size_t size);
+
+  template <class T>
+  int addValue(int stream, int64_t at, T value);
+};
+
+M2XBatch::M2XBatch(void* arena, size_t size, int max_streams) : _arena((uint8_t*) arena),
+                                                                _size(size),
+                                                                _max_streams(max_streams),
+                                                                _stream_count(0) {
+  reset();
+}
+
+// Bump allocates +size+ bytes from the arena, 8 byte aligned
+void* M2XBatch::allocate(size_t size) {
+  uintptr_t base = (uintptr_t) _arena;
+  size_t start = (size_t) (((base + _used + 7) & ~(uintptr_t) 7) - base);
+
+  if (start > _size || size > _size - start) { return NULL; }
+  _used = start + size;
+  return _arena + start;
+}
+
+void M2XBatch::reset() {
+  _used = 0;
+  _stream_count = 0;
+  _streams = (M2XBatchStream*) allocate(_max_streams * sizeof(M2XBatchStream));
+  if (_streams == NULL) { _max_streams = 0; }
+}
+
+void M2XBatch::clear() {
+  for (int i = 0; i < _stream_count; i++) { _streams[i].count = 0; }
+}
+
+int M2XBatch::addStream(const char* name, uint8_t type, int capacity) {
+  size_t name_length = strlen(name), saved = _used;
+  size_t value_size = (type == M2X_BATCH_DOUBLE) ? sizeof(double) :
+      (type == M2X_BATCH_FLOAT) ? sizeof(float) : sizeof(int32_t);
+  M2XBatchStream* s;
+  char* copy;
+
+  if (type > M2X_BATCH_DOUBLE || capacity <= 0 || capacity > 0xFFFF ||
+      name_length > 0xFFFF) {
+    return E_INVALID;
+  }
+  if (_stream_count == _max_streams) { return E_BUFFER_TOO_SMALL; }
+  s = &_streams[_stream_count];
+  s->ats = (int64_t*) allocate(capacity * sizeof(int64_t));
+  s->values = allocate(capacity * value_size);
+  copy = (char*) allocate(name_length);
+  if (s->ats == NULL || s->values == NULL || copy == NULL) {
+    _used = saved;
+    return E_BUFFER_TOO_SMALL;
+  }
+  memcpy(copy, name, name_length);
+  s->name = copy;
+  s->name_length = (uint16_t) name_length;
+  s->type = type;
+  s->count = 0;
+  s->capacity = (uint16_t) capacity;
+  return _stream_count++;
+}
+
+template <class T>
+int M2XBatch::addValue(int stream, int64_t at, T value) {
+  M2XBatchStream* s;
+
+  if (stream < 0 || stream >= _stream_count) { return E_INVALID; }
+  s = &_streams[stream];
+  if (s->count == s->capacity) { return E_BUFFER_TOO_SMALL; }
+  s->ats[s->count] = at;
+  if (s->type == M2X_BATCH_DOUBLE) {
+    ((double*) s->values)[s->count] = (double) value;
+  } else if (s->type == M2X_BATCH_FLOAT) {
+    ((float*) s->values)[s->count] = (float) value;
+  } else {
+    ((int32_t*) s->values)[s->count] = (int32_t) value;
+  }
+  s->count++;
+  return E_OK;
+}
+
+int M2XBatch::add(int stream, int64_t at, int value) {
+  return addValue(stream, at, value);
+}
+
+int M2XBatch::add(int stream, int64_t at, long value) {
+  return addValue(stream, at, value);
+}
+
+int M2XBatch::add(int stream, int64_t at, float value) {
+  return addValue(stream, at, value);
+}
+
+int M2XBatch::add(int stream, int64_t at, double value) {
+  return addValue(stream, at, value);
+}
+
+int M2XBatch::valueCount() const {
+  int count = 0;
+  for (int i = 0; i < _stream_count; i++) { count += _streams[i].count; }
+  return count;
+}
+
+#endif  /* M2X_BATCH_H_ */
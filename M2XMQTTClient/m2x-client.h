@@ -0,0 +1,87 @@
+#ifndef M2X_CLIENT_H_
+#define M2X_CLIENT_H_
+
+#include "m2x-config.h"
+#include "m2x-print.h"
+
+/*
+ * Arduino style TCP client interface. M2XMQTTClient only talks to the
+ * server through this, each platform provides a TCPClient implementing it.
+ */
+class Client : public Print {
+public:
+  virtual ~Client() {}
+
+  virtual int connect(const char *host, uint16_t port) = 0;
+  virtual size_t write(uint8_t) = 0;
+  virtual size_t write(const uint8_t *buf, size_t size) = 0;
+  // Number of bytes that can be read without waiting. When none are
+  // buffered, this may wait for data up to the client's timeout.
+  virtual int available() = 0;
+  // Like available(), but never waits for data to arrive. Clients that
+  // can't check without waiting fall back to available().
+  virtual int availableNow() { return available(); }
+  virtual int read() = 0;
+  // Reads up to +size+ bytes into +buf+, waiting for more data only when
+  // the buffered bytes are not enough. Returns the number of bytes read.
+  virtual int read(uint8_t *buf, size_t size) = 0;
+  virtual void flush() = 0;
+  virtual void stop() = 0;
+  virtual uint8_t connected() = 0;
+};
+
+/*
+ * Fixed capacity byte FIFO. Data is received straight into the free region
+ * returned by tail() and consumed with read(), so nothing is ever moved
+ * around inside the buffer.
+ */
+template <size_t N>
+class M2XRingBuffer {
+public:
+  M2XRingBuffer() : _head(0), _count(0) {}
+
+  size_t size() const { return _count; }
+  void clear() { _head = _count = 0; }
+
+  // Returns the largest contiguous free region and stores its length in
+  // +length+, call commit() with the number of bytes stored there.
+  uint8_t* tail(size_t* length) {
+    size_t t = (_head + _count) % N;
+    if (_count == N) {
+      *length = 0;
+    } else if (t >= _head) {
+      *length = N - t;
+    } else {
+      *length = _head - t;
+    }
+    return _data + t;
+  }
+
+  void commit(size_t length) {
+    _count += length;
+  }
+
+  size_t read(uint8_t* buf, size_t size) {
+    size_t total = 0, tmp;
+    while (size && _count) {
+      tmp = N - _head;
+      if (tmp > _count) tmp = _count;
+      if (tmp > size) tmp = size;
+      memcpy(buf, _data + _head, tmp);
+      _head = (_head + tmp) % N;
+      _count -= tmp;
+      buf += tmp;
+      size -= tmp;
+      total += tmp;
+    }
+    /* Keep the free region contiguous whenever possible */
+    if (_count == 0) { _head = 0; }
+    return total;
+  }
+private:
+  uint8_t _data[N];
+  size_t _head;
+  size_t _count;
+};
+
+#endif  /* M2X_CLIENT_H_ */
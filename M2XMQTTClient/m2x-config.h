@@ -0,0 +1,131 @@
+#ifndef M2X_CONFIG_H_
+#define M2X_CONFIG_H_
+
+/*
+ * Compile-time configuration of the client
+ *
+ * Every buffer and table of the client has a fixed size set here, nothing
+ * is allocated on the heap, so the RAM a client takes is known when it is
+ * compiled: M2X_CLIENT_RAM_SIZE in M2XMQTTClient.h. Define any of these
+ * before including M2XMQTTClient.h to change them. Define M2X_RAM_BUDGET to
+ * the number of bytes a client and its default TCPClient may take, and
+ * compilation fails when they don't fit.
+ */
+
+/*
+ * Size of the buffer each request is rendered into, this holds the request
+ * topic (key length + 15 bytes) followed by the JSON payload. A payload that
+ * fits is measured and sent in a single pass, a larger one is rendered a
+ * second time straight into the MQTT stream.
+ */
+#ifndef M2X_PAYLOAD_BUFFER_SIZE
+#define M2X_PAYLOAD_BUFFER_SIZE 320
+#endif
+
+/*
+ * Number of floating point values of a payload too large for
+ * M2X_PAYLOAD_BUFFER_SIZE whose precision, one byte each, is kept from
+ * measuring the payload for sending it. Values beyond it are searched for
+ * their shortest form twice.
+ */
+#ifndef M2X_FORMAT_CACHE_SIZE
+#define M2X_FORMAT_CACHE_SIZE 64
+#endif
+
+/*
+ * Number of requests that can wait for a response at the same time. Request
+ * IDs map onto this table by modulo, so submitting a request whose slot is
+ * still taken waits for the older request to finish first.
+ */
+#ifndef M2X_MAX_PENDING_REQUESTS
+#define M2X_MAX_PENDING_REQUESTS 4
+#endif
+
+/*
+ * How long a request waits for its response. A request whose response
+ * doesn't arrive in time completes with E_TIMEOUT and frees its slot, so a
+ * lost response can't block the requests mapped onto the same slot.
+ */
+#ifndef M2X_REQUEST_TIMEOUT_MS
+#define M2X_REQUEST_TIMEOUT_MS 30000
+#endif
+
+/*
+ * Number of QoS 1 requests kept in RAM until the server acknowledges them,
+ * each slot takes M2X_PAYLOAD_BUFFER_SIZE bytes. Sending another QoS 1
+ * request while all slots are taken waits for a PUBACK first. With the
+ * default of 0 no slots are reserved and the retransmit code is left out:
+ * QoS 1 requests are still acknowledged, but fail with E_DISCONNECTED when
+ * the connection drops, just like QoS 0 ones.
+ */
+#ifndef M2X_MAX_UNACKED_PUBLISHES
+#define M2X_MAX_UNACKED_PUBLISHES 0
+#endif
+
+/*
+ * Number of message handlers that can be registered, see
+ * M2XMQTTClient::setMessageHandler. Each handler of a type other than
+ * "responses" adds a topic to the subscription.
+ */
+#ifndef M2X_MAX_MESSAGE_HANDLERS
+#define M2X_MAX_MESSAGE_HANDLERS 2
+#endif
+
+/* Longest message type, i.e. last topic segment, handlers can match */
+#ifndef M2X_MESSAGE_TYPE_SIZE
+#define M2X_MESSAGE_TYPE_SIZE 15
+#endif
+
+#if M2X_MESSAGE_TYPE_SIZE < 9
+#error "M2X_MESSAGE_TYPE_SIZE must hold at least \"responses\""
+#endif
+
+/* Bytes of a message payload kept for its handler, longer payloads are
+ * delivered truncated */
+#ifndef M2X_MESSAGE_BUFFER_SIZE
+#define M2X_MESSAGE_BUFFER_SIZE 256
+#endif
+
+/* Default capacity of the TCPClient input and output buffers */
+#ifndef M2X_CLIENT_BUFFER_SIZE
+#define M2X_CLIENT_BUFFER_SIZE 128
+#endif
+
+/* Bytes read from the TCPClient at a time, on the stack */
+#ifndef M2X_READ_CHUNK_SIZE
+#define M2X_READ_CHUNK_SIZE 32
+#endif
+
+/* Buckets of each latency histogram. Bucket 0 counts times under 1 ms,
+ * bucket i times from 2^(i-1) up to 2^i ms, and the last bucket everything
+ * longer, 16 buckets reach 16 seconds */
+#ifndef M2X_HISTOGRAM_BUCKETS
+#define M2X_HISTOGRAM_BUCKETS 16
+#endif
+
+/*
+ * Keepalive interval announced to the server. A PINGREQ is sent once
+ * nothing was sent for half of it, and the connection is considered dead
+ * if the PINGRESP doesn't arrive within M2X_PING_TIMEOUT_MS.
+ */
+#ifndef M2X_KEEPALIVE_SECONDS
+#define M2X_KEEPALIVE_SECONDS 60
+#endif
+
+#ifndef M2X_PING_TIMEOUT_MS
+#define M2X_PING_TIMEOUT_MS 10000
+#endif
+
+/*
+ * Bounds of the delay between failed connection attempts, which doubles
+ * after each failure
+ */
+#ifndef M2X_RECONNECT_MIN_MS
+#define M2X_RECONNECT_MIN_MS 1000
+#endif
+
+#ifndef M2X_RECONNECT_MAX_MS
+#define M2X_RECONNECT_MAX_MS 60000
+#endif
+
+#endif  /* M2X_CONFIG_H_ */
@@ -0,0 +1,411 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USER_AGENT "User-Agent: M2X Linux MQTT Client/" M2X_VERSION
+
+#ifdef DEBUG
+#define DBG(fmt_, data_) printf((fmt_), (data_))
+#define DBGLN(fmt_, data_) printf((fmt_), (data_)); printf("\n")
+#define DBGLNEND printf("\n")
+#endif  /* DEBUG */
+
+#define F(str) str
+
+/* Time to wait for a socket to become readable or writable */
+#ifndef M2X_LINUX_SOCKET_TIMEOUT_MS
+#define M2X_LINUX_SOCKET_TIMEOUT_MS 1500
+#endif
+
+template <class T>
+static inline T min(T a, T b) {
+  return (a < b) ? a : b;
+}
+
+static inline uint64_t m2x_monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+class M2XTimer {
+public:
+  M2XTimer() : _start(0) {}
+
+  void start() { _start = m2x_monotonic_ms(); }
+
+  // Milliseconds since start(), CLOCK_MONOTONIC doesn't overflow in practice
+  uint64_t read_ms64() {
+    return m2x_monotonic_ms() - _start;
+  }
+
+  // Same, wrapping around every 49 days where unsigned long is 32 bits
+  unsigned long read_ms() {
+    return (unsigned long) read_ms64();
+  }
+private:
+  uint64_t _start;
+};
+
+// Atomically sets *+ptr+ to +desired+ if it holds +expected+, returns true
+// if it did. Acts as a full memory barrier.
+static inline bool m2x_atomic_cas(volatile uint32_t* ptr, uint32_t expected, uint32_t desired) {
+  return __sync_bool_compare_and_swap(ptr, expected, desired);
+}
+
+static inline void m2x_memory_barrier() {
+  __sync_synchronize();
+}
+
+void delay(int ms)
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR) ;
+}
+
+#include "m2x-client.h"
+
+/*
+ * TCP Client
+ *
+ * +IN_SIZE+ and +OUT_SIZE+ set the capacity of the input and output buffers.
+ *
+ * The socket is always non-blocking. When the client has to wait for data
+ * or for room in the kernel send buffer, it waits at most +timeout_ms+ for
+ * the socket to become ready, a timeout of 0 means it never waits (connect()
+ * still waits up to M2X_LINUX_SOCKET_TIMEOUT_MS). With a timeout of 0, bytes
+ * the send buffer has no room for stay in the output buffer and go out on
+ * the next call; only a write() that finds the output buffer full waits for
+ * room, for up to M2X_LINUX_SOCKET_TIMEOUT_MS. This lets one thread drive
+ * many connections: register each client with an M2XEventLoop, use a timeout
+ * of 0 together with M2XMQTTClient::setFastConnect(), and only read from the
+ * clients the loop reports as readable.
+ */
+template <size_t IN_SIZE = M2X_CLIENT_BUFFER_SIZE, size_t OUT_SIZE = IN_SIZE>
+class TCPClient : public Client {
+public:
+  TCPClient(int timeout_ms = M2X_LINUX_SOCKET_TIMEOUT_MS);
+  ~TCPClient();
+
+  virtual int connect(const char *host, uint16_t port);
+  virtual size_t write(uint8_t);
+  virtual size_t write(const uint8_t *buf, size_t size);
+  virtual int available();
+  virtual int availableNow();
+  virtual int read();
+  virtual int read(uint8_t *buf, size_t size);
+  virtual void flush();
+  virtual void stop();
+  virtual uint8_t connected();
+
+  int fd() const { return _fd; }
+  void setTimeout(int timeout_ms) { _timeout_ms = timeout_ms; }
+private:
+  bool _wait(short events, int timeout_ms);
+  void _fillin(int timeout_ms);
+  M2XRingBuffer<IN_SIZE> _inbuf;
+  void _flushout(bool wait);
+  uint8_t _outbuf[OUT_SIZE];
+  size_t _outcnt;
+  int _fd;
+  int _timeout_ms;
+  bool _closed;
+};
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+TCPClient<IN_SIZE, OUT_SIZE>::TCPClient(int timeout_ms) : _inbuf(), _outcnt(0), _fd(-1),
+                                                          _timeout_ms(timeout_ms),
+                                                          _closed(true) {
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+TCPClient<IN_SIZE, OUT_SIZE>::~TCPClient() {
+  stop();
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+bool TCPClient<IN_SIZE, OUT_SIZE>::_wait(short events, int timeout_ms) {
+  struct pollfd pfd;
+  int ret;
+
+  if (timeout_ms <= 0) { return false; }
+  pfd.fd = _fd;
+  pfd.events = events;
+  pfd.revents = 0;
+  do {
+    ret = ::poll(&pfd, 1, timeout_ms);
+  } while (ret == -1 && errno == EINTR);
+  return ret > 0;
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::connect(const char *host, uint16_t port) {
+  struct addrinfo hints, *result, *rp;
+  char service[6];
+  int err;
+  socklen_t err_length;
+
+  stop();
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+  if (getaddrinfo(host, service, &hints, &result) != 0) { return 0; }
+
+  for (rp = result; rp != NULL; rp = rp->ai_next) {
+    _fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                 rp->ai_protocol);
+    if (_fd == -1) { continue; }
+    if (::connect(_fd, rp->ai_addr, rp->ai_addrlen) == 0) { break; }
+    /* Connecting always waits, even when reads and writes don't */
+    if (errno == EINPROGRESS &&
+        _wait(POLLOUT, _timeout_ms > 0 ? _timeout_ms : M2X_LINUX_SOCKET_TIMEOUT_MS)) {
+      err = 0;
+      err_length = sizeof(err);
+      if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &err_length) == 0 &&
+          err == 0) {
+        break;
+      }
+    }
+    ::close(_fd);
+    _fd = -1;
+  }
+  freeaddrinfo(result);
+  if (_fd == -1) { return 0; }
+
+  /* Requests are written in one go, there's nothing to gain from Nagle */
+  err = 1;
+  setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &err, sizeof(err));
+  _inbuf.clear();
+  _outcnt = 0;
+  _closed = false;
+  return 1;
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+size_t TCPClient<IN_SIZE, OUT_SIZE>::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+size_t TCPClient<IN_SIZE, OUT_SIZE>::write(const uint8_t *buf, size_t size) {
+  size_t cnt = 0;
+  while (size) {
+    size_t tmp = OUT_SIZE - _outcnt;
+    if (tmp > size) tmp = size;
+    memcpy(_outbuf + _outcnt, buf, tmp);
+    _outcnt += tmp;
+    buf += tmp;
+    size -= tmp;
+    cnt += tmp;
+    // if no space flush it, waiting for room since the caller can't
+    if (_outcnt == OUT_SIZE)
+        _flushout(true);
+  }
+  return cnt;
+}
+
+// Sends what the socket takes of the output buffer. A full send buffer is
+// normal backpressure: unless +wait+ is set, the unsent bytes are kept for
+// the next call. With +wait+ set, room is waited for up to the timeout, or
+// M2X_LINUX_SOCKET_TIMEOUT_MS when the timeout is 0.
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::_flushout(bool wait)
+{
+  size_t sent = 0;
+  ssize_t tmp;
+
+  while (sent < _outcnt && !_closed) {
+    tmp = ::send(_fd, _outbuf + sent, _outcnt - sent, MSG_NOSIGNAL);
+    if (tmp > 0) {
+      sent += tmp;
+    } else if (tmp == -1 && errno == EINTR) {
+      continue;
+    } else if (tmp == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!wait) { break; }
+      if (_wait(POLLOUT, _timeout_ms > 0 ? _timeout_ms : M2X_LINUX_SOCKET_TIMEOUT_MS)) {
+        continue;
+      }
+      // The peer stopped reading for the whole timeout
+      _closed = true;
+    } else {
+      // Peer is gone, the stream is now broken
+      _closed = true;
+    }
+  }
+  if (_closed) {
+    _outcnt = 0;
+  } else {
+    memmove(_outbuf, _outbuf + sent, _outcnt - sent);
+    _outcnt -= sent;
+  }
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::_fillin(int timeout_ms)
+{
+  size_t length;
+  uint8_t* tail = _inbuf.tail(&length);
+  ssize_t tmp;
+
+  if (length == 0 || _closed) { return; }
+  while (true) {
+    tmp = ::recv(_fd, tail, length, 0);
+    if (tmp > 0) {
+      _inbuf.commit(tmp);
+      return;
+    }
+    if (tmp == -1 && errno == EINTR) { continue; }
+    if (tmp == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      _closed = true;
+      return;
+    }
+    if (!_wait(POLLIN, timeout_ms)) { return; }
+  }
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::flush() {
+  _flushout(_timeout_ms > 0);
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::available() {
+  if (_inbuf.size() == 0) {
+    _flushout(_timeout_ms > 0);
+    _fillin(_timeout_ms);
+  }
+  return _inbuf.size();
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::availableNow() {
+  if (_inbuf.size() == 0) {
+    _flushout(false);
+    _fillin(0);
+  }
+  return _inbuf.size();
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::read() {
+  uint8_t ch;
+  return (read(&ch, 1) == 1) ? ch : -1;
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::read(uint8_t *buf, size_t size) {
+  int cnt = 0;
+  while (size) {
+    // need more
+    if (size > _inbuf.size()) {
+      _flushout(_timeout_ms > 0);
+      _fillin(_timeout_ms);
+    }
+    if (_inbuf.size() > 0) {
+      size_t tmp = _inbuf.read(buf, size);
+      size -= tmp;
+      buf += tmp;
+      cnt += tmp;
+    } else // no data
+        break;
+  }
+  return cnt;
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::stop() {
+  if (_fd != -1) {
+    ::close(_fd);
+    _fd = -1;
+  }
+  _closed = true;
+  _inbuf.clear();
+  _outcnt = 0;
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+uint8_t TCPClient<IN_SIZE, OUT_SIZE>::connected() {
+  return (_fd != -1 && (!_closed || _inbuf.size() > 0)) ? 1 : 0;
+}
+
+/*
+ * epoll based readiness notification for many clients
+ *
+ * Each registered socket is associated with a context pointer, usually the
+ * M2XMQTTClient using it. wait() returns the contexts of the clients that
+ * have data to read (or were closed by the peer), which can then be polled
+ * without blocking.
+ */
+class M2XEventLoop {
+public:
+  M2XEventLoop();
+  ~M2XEventLoop();
+
+  // Starts watching the socket +fd+ of a connected TCPClient. Returns 0 on
+  // success, -1 on error. Reconnecting gives the client a new socket, so it
+  // has to be added again.
+  int add(int fd, void* context);
+  int remove(int fd);
+
+  // Waits up to +timeout_ms+ (-1 waits forever) for registered clients to
+  // become readable, and stores up to +max_ready+ of their contexts in
+  // +ready+. Returns the number of contexts stored, or -1 on error.
+  int wait(void** ready, int max_ready, int timeout_ms);
+private:
+  int _epfd;
+};
+
+M2XEventLoop::M2XEventLoop() {
+  _epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+M2XEventLoop::~M2XEventLoop() {
+  if (_epfd != -1) { ::close(_epfd); }
+}
+
+int M2XEventLoop::add(int fd, void* context) {
+  struct epoll_event event;
+
+  if (fd == -1) { return -1; }
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = context;
+  return epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int M2XEventLoop::remove(int fd) {
+  struct epoll_event event;
+
+  if (fd == -1) { return -1; }
+  return epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, &event);
+}
+
+int M2XEventLoop::wait(void** ready, int max_ready, int timeout_ms) {
+  struct epoll_event events[64];
+  int count, i;
+
+  if (max_ready > 64) { max_ready = 64; }
+  do {
+    count = epoll_wait(_epfd, events, max_ready, timeout_ms);
+  } while (count == -1 && errno == EINTR);
+  for (i = 0; i < count; i++) {
+    ready[i] = events[i].data.ptr;
+  }
+  return count;
+}
@@ -0,0 +1,402 @@
+#ifndef M2X_LOOPBACK_H_
+#define M2X_LOOPBACK_H_
+
+#ifndef LINUX_PLATFORM
+#error "M2XLoopbackClient is only available on Linux!"
+#endif
+
+/*
+ * In-process stand-in for the M2X MQTT server, for tests and benchmarks
+ */
+#include "M2XMQTTClient.h"
+
+/* Capacity of the buffer of packets waiting to be read by the client */
+#ifndef M2X_LOOPBACK_BUFFER_SIZE
+#define M2X_LOOPBACK_BUFFER_SIZE 1024
+#endif
+
+/* Responses that can wait for their latency to pass at once */
+#ifndef M2X_LOOPBACK_PENDING_SIZE
+#define M2X_LOOPBACK_PENDING_SIZE 64
+#endif
+
+/* Bytes kept from the start of each packet, enough for the topic, the
+ * packet ID and the request ID at the start of the payload */
+#define M2X_LOOPBACK_HEAD_SIZE 160
+
+/* Longest request ID kept, a 16 bit integer fits */
+#define M2X_LOOPBACK_ID_SIZE 12
+
+// Client answering M2XMQTTClient like the M2X MQTT server would, without
+// any network.
+//
+// It speaks the subset of MQTT the client uses: CONNECT is answered with
+// CONNACK, SUBSCRIBE with SUBACK, PINGREQ with PINGRESP and QoS 1 PUBLISH
+// packets with PUBACK, right away. Each request published on
+// "m2x/<key>/requests" is answered on "m2x/<key>/responses" with
+// {"id":"<id>","status":<status>} once its latency has passed. Request
+// bodies are not looked at, only the first M2X_LOOPBACK_HEAD_SIZE bytes of
+// each packet are kept, so requests of any size can be sent.
+//
+// Responses can be made slower with setLatency(), lost with setDropRate()
+// and delivered out of order with setReorderRate(). Random decisions come
+// from a fixed seed, so runs are repeatable.
+//
+// Like TCPClient, reading waits up to +timeout_ms+ for a pending response
+// to become due. It never waits when no response is pending.
+class M2XLoopbackClient : public Client {
+public:
+  M2XLoopbackClient(int timeout_ms = M2X_LINUX_SOCKET_TIMEOUT_MS);
+
+  virtual int connect(const char *host, uint16_t port);
+  virtual size_t write(uint8_t);
+  virtual size_t write(const uint8_t *buf, size_t size);
+  virtual int available();
+  virtual int availableNow();
+  virtual int read();
+  virtual int read(uint8_t *buf, size_t size);
+  virtual void flush();
+  virtual void stop();
+  virtual uint8_t connected();
+
+  // Each response is sent +latency_ms+ plus up to +jitter_ms+ milliseconds
+  // after its request
+  void setLatency(unsigned long latency_ms, unsigned long jitter_ms = 0);
+  // Percentage of requests left without a response
+  void setDropRate(int percent) { _drop_rate = percent; }
+  // Percentage of responses held back so that later ones overtake them
+  void setReorderRate(int percent) { _reorder_rate = percent; }
+  // Status code of the responses, 202 by default
+  void setStatus(int status) { _status = status; }
+  void setSeed(uint32_t seed) { _seed = seed ? seed : 1; }
+  void setTimeout(int timeout_ms) { _timeout_ms = timeout_ms; }
+
+  // Counters since the client was created
+  unsigned long writes() const { return _writes; }
+  unsigned long bytesWritten() const { return _bytes_written; }
+  unsigned long published() const { return _published; }
+  unsigned long responded() const { return _responded; }
+  unsigned long dropped() const { return _dropped; }
+
+private:
+  struct Pending {
+    uint64_t due;
+    char id[M2X_LOOPBACK_ID_SIZE];
+  };
+
+  M2XRingBuffer<M2X_LOOPBACK_BUFFER_SIZE> _inbuf;
+  bool _connected;
+  int _timeout_ms;
+
+  /* Packet being written by the client */
+  uint8_t _state;
+  uint8_t _type;
+  uint32_t _length;
+  uint8_t _shift;
+  uint32_t _remaining;
+  uint8_t _head[M2X_LOOPBACK_HEAD_SIZE];
+  size_t _head_size;
+
+  char _topic[M2X_LOOPBACK_HEAD_SIZE];
+  Pending _pending[M2X_LOOPBACK_PENDING_SIZE];
+  int _pending_count;
+
+  unsigned long _latency_ms;
+  unsigned long _jitter_ms;
+  int _drop_rate;
+  int _reorder_rate;
+  int _status;
+  uint32_t _seed;
+
+  unsigned long _writes;
+  unsigned long _bytes_written;
+  unsigned long _published;
+  unsigned long _responded;
+  unsigned long _dropped;
+
+  uint32_t random();
+  bool push(const uint8_t* buf, size_t size);
+  void handlePacket();
+  void handlePublish();
+  void deliver();
+};
+
+M2XLoopbackClient::M2XLoopbackClient(int timeout_ms) : _inbuf(),
+                                                       _connected(false),
+                                                       _timeout_ms(timeout_ms),
+                                                       _state(0),
+                                                       _pending_count(0),
+                                                       _latency_ms(0),
+                                                       _jitter_ms(0),
+                                                       _drop_rate(0),
+                                                       _reorder_rate(0),
+                                                       _status(202),
+                                                       _seed(1),
+                                                       _writes(0),
+                                                       _bytes_written(0),
+                                                       _published(0),
+                                                       _responded(0),
+                                                       _dropped(0) {
+  _topic[0] = '\0';
+}
+
+void M2XLoopbackClient::setLatency(unsigned long latency_ms, unsigned long jitter_ms) {
+  _latency_ms = latency_ms;
+  _jitter_ms = jitter_ms;
+}
+
+/* xorshift32 */
+uint32_t M2XLoopbackClient::random() {
+  _seed ^= _seed << 13;
+  _seed ^= _seed >> 17;
+  _seed ^= _seed << 5;
+  return _seed;
+}
+
+int M2XLoopbackClient::connect(const char *, uint16_t) {
+  stop();
+  _connected = true;
+  return 1;
+}
+
+void M2XLoopbackClient::stop() {
+  _connected = false;
+  _inbuf.clear();
+  _state = 0;
+  _pending_count = 0;
+  _topic[0] = '\0';
+}
+
+uint8_t M2XLoopbackClient::connected() {
+  return (_connected || _inbuf.size() > 0) ? 1 : 0;
+}
+
+void M2XLoopbackClient::flush() {
+}
+
+size_t M2XLoopbackClient::write(uint8_t b) {
+  return write(&b, 1);
+}
+
+size_t M2XLoopbackClient::write(const uint8_t *buf, size_t size) {
+  size_t i = 0, tmp;
+
+  /* Like a broken TCPClient, data written after closing is discarded */
+  if (!_connected) { return size; }
+  _writes++;
+  _bytes_written += size;
+  while (i < size) {
+    if (_state == 0) {
+      /* Fixed header */
+      _type = buf[i++];
+      _length = 0;
+      _shift = 0;
+      _state = 1;
+    } else if (_state == 1) {
+      /* Remaining length */
+      _length |= (uint32_t) (buf[i] & 0x7F) << _shift;
+      _shift += 7;
+      if ((buf[i++] & 0x80) == 0) {
+        _remaining = _length;
+        _head_size = 0;
+        _state = 2;
+        if (_remaining == 0) {
+          handlePacket();
+          _state = 0;
+        }
+      }
+    } else {
+      /* Body, only the start is kept */
+      tmp = min(size - i, (size_t) _remaining);
+      if (_head_size < sizeof(_head)) {
+        memcpy(_head + _head_size, buf + i, min(tmp, sizeof(_head) - _head_size));
+        _head_size += min(tmp, sizeof(_head) - _head_size);
+      }
+      i += tmp;
+      _remaining -= tmp;
+      if (_remaining == 0) {
+        handlePacket();
+        _state = 0;
+      }
+    }
+  }
+  return size;
+}
+
+bool M2XLoopbackClient::push(const uint8_t* buf, size_t size) {
+  uint8_t* tail;
+  size_t length;
+
+  if (M2X_LOOPBACK_BUFFER_SIZE - _inbuf.size() < size) { return false; }
+  while (size > 0) {
+    tail = _inbuf.tail(&length);
+    length = min(length, size);
+    memcpy(tail, buf, length);
+    _inbuf.commit(length);
+    buf += length;
+    size -= length;
+  }
+  return true;
+}
+
+void M2XLoopbackClient::handlePacket() {
+  uint8_t packet[5];
+
+  switch (_type & 0xF0) {
+    case 0x10:
+      /* CONNECT, accepted without a session */
+      packet[0] = 0x20; packet[1] = 0x02; packet[2] = 0x00; packet[3] = 0x00;
+      push(packet, 4);
+      break;
+    case 0x80:
+      /* SUBSCRIBE, granted at QoS 0 */
+      if (_head_size < 2) { break; }
+      packet[0] = 0x90; packet[1] = 0x03;
+      packet[2] = _head[0]; packet[3] = _head[1]; packet[4] = 0x00;
+      push(packet, 5);
+      break;
+    case 0x30:
+      handlePublish();
+      break;
+    case 0xC0:
+      packet[0] = 0xD0; packet[1] = 0x00;
+      push(packet, 2);
+      break;
+    case 0xE0:
+      _connected = false;
+      break;
+  }
+}
+
+void M2XLoopbackClient::handlePublish() {
+  static const char requests[] = "/requests";
+  static const char id_key[] = "\"id\":\"";
+  uint8_t packet[4];
+  size_t topic_length, pos, i;
+  Pending* pending;
+
+  _published++;
+  if (_head_size < 2) { return; }
+  topic_length = ((size_t) _head[0] << 8) | _head[1];
+  pos = 2 + topic_length;
+  if (_type & 0x06) {
+    /* QoS 1, acknowledge right away */
+    if (pos + 2 > _head_size) { return; }
+    packet[0] = 0x40; packet[1] = 0x02;
+    packet[2] = _head[pos]; packet[3] = _head[pos + 1];
+    push(packet, 4);
+    pos += 2;
+  }
+  if (pos > _head_size || topic_length < sizeof(requests) - 1 ||
+      memcmp(_head + 2 + topic_length - (sizeof(requests) - 1), requests,
+             sizeof(requests) - 1) != 0) {
+    return;
+  }
+  /* "m2x/<key>/requests" is answered on "m2x/<key>/responses" */
+  memcpy(_topic, _head + 2, topic_length - (sizeof(requests) - 1));
+  strcpy(_topic + topic_length - (sizeof(requests) - 1), "/responses");
+
+  /* The request ID comes first in the payload */
+  for (; pos + sizeof(id_key) - 1 <= _head_size; pos++) {
+    if (memcmp(_head + pos, id_key, sizeof(id_key) - 1) == 0) { break; }
+  }
+  pos += sizeof(id_key) - 1;
+  if (pos > _head_size) { return; }
+
+  if ((int) (random() % 100) < _drop_rate ||
+      _pending_count == M2X_LOOPBACK_PENDING_SIZE) {
+    _dropped++;
+    return;
+  }
+  pending = &_pending[_pending_count];
+  for (i = 0; pos + i < _head_size && _head[pos + i] != '"'; i++) {
+    if (i == M2X_LOOPBACK_ID_SIZE - 1) { return; }
+    pending->id[i] = _head[pos + i];
+  }
+  pending->id[i] = '\0';
+  pending->due = m2x_monotonic_ms() + _latency_ms;
+  if (_jitter_ms > 0) { pending->due += random() % (_jitter_ms + 1); }
+  if ((int) (random() % 100) < _reorder_rate) {
+    /* Held back past the latest time any later response can be due */
+    pending->due += _latency_ms + _jitter_ms + 1;
+  }
+  _pending_count++;
+}
+
+// Moves the responses that are due, earliest first, to the input buffer
+void M2XLoopbackClient::deliver() {
+  uint8_t packet[M2X_LOOPBACK_HEAD_SIZE + 48];
+  uint64_t now;
+  size_t topic_length, length, start;
+  int i, next, payload;
+
+  if (_pending_count == 0) { return; }
+  now = m2x_monotonic_ms();
+  while (_pending_count > 0) {
+    next = 0;
+    for (i = 1; i < _pending_count; i++) {
+      if (_pending[i].due < _pending[next].due) { next = i; }
+    }
+    if (_pending[next].due > now) { break; }
+
+    topic_length = strlen(_topic);
+    payload = snprintf((char*) packet + 5 + topic_length, sizeof(packet) - 5 - topic_length,
+                       "{\"id\":\"%s\",\"status\":%d}", _pending[next].id, _status);
+    length = 2 + topic_length + payload;
+    packet[3] = (uint8_t) (topic_length >> 8);
+    packet[4] = (uint8_t) topic_length;
+    memcpy(packet + 5, _topic, topic_length);
+    /* Remaining length takes 1 or 2 bytes right before the topic */
+    if (length < 128) {
+      packet[1] = 0x30;
+      packet[2] = (uint8_t) length;
+      start = 1;
+    } else {
+      packet[0] = 0x30;
+      packet[1] = (uint8_t) (length | 0x80);
+      packet[2] = (uint8_t) (length >> 7);
+      start = 0;
+    }
+    if (!push(packet + start, 3 - start + length)) { break; }
+
+    _responded++;
+    _pending_count--;
+    /* Keep the order of the remaining responses */
+    memmove(&_pending[next], &_pending[next + 1],
+            (_pending_count - next) * sizeof(Pending));
+  }
+}
+
+int M2XLoopbackClient::available() {
+  uint64_t now, due;
+  int i;
+
+  deliver();
+  if (_inbuf.size() == 0 && _pending_count > 0 && _timeout_ms > 0) {
+    due = _pending[0].due;
+    for (i = 1; i < _pending_count; i++) {
+      if (_pending[i].due < due) { due = _pending[i].due; }
+    }
+    now = m2x_monotonic_ms();
+    if (due > now) { delay((int) min(due - now, (uint64_t) _timeout_ms)); }
+    deliver();
+  }
+  return _inbuf.size();
+}
+
+int M2XLoopbackClient::availableNow() {
+  deliver();
+  return _inbuf.size();
+}
+
+int M2XLoopbackClient::read() {
+  uint8_t ch;
+  return (read(&ch, 1) == 1) ? ch : -1;
+}
+
+int M2XLoopbackClient::read(uint8_t *buf, size_t size) {
+  if (size > _inbuf.size()) { deliver(); }
+  return _inbuf.read(buf, size);
+}
+
+#endif  /* M2X_LOOPBACK_H_ */
@@ -9,28 +9,75 @@
 
 #define F(str) str
 
+/* Time to wait for the socket to receive data or to send */
+#ifndef M2X_MBED_SOCKET_TIMEOUT_MS
+#define M2X_MBED_SOCKET_TIMEOUT_MS 1500
+#endif
+
 class M2XTimer {
 public:
-  void start() { _timer.start(); }
+  M2XTimer() : _last_us(0), _elapsed_us(0) {}
+
+  void start() {
+    _timer.reset();
+    _timer.start();
+    _last_us = 0;
+    _elapsed_us = 0;
+  }
 
+  // Milliseconds since start(). The mbed ticker itself overflows every 71
+  // minutes, so the time elapsed between calls is accumulated in 64 bits
+  // instead, which stays correct as long as this is called at least once
+  // every 71 minutes.
+  uint64_t read_ms64() {
+    uint32_t now = (uint32_t) _timer.read_us();
+    _elapsed_us += (uint32_t) (now - _last_us);
+    _last_us = now;
+    return _elapsed_us / 1000;
+  }
+
+  // Same, wrapping around every 49 days where unsigned long is 32 bits
   unsigned long read_ms() {
-    // In case of a timestamp overflow, we reset the server timestamp recorded.
-    // Notice that unlike Arduino, mbed would overflow every 30 minutes,
-    // so if 2 calls to this API are more than 30 minutes apart, we are
-    // likely to run into troubles. This is a limitation of the current
-    // mbed platform. However, we argue that it might be a rare case that
-    // 2 calls to this are 30 minutes apart. In most cases, we would call
-    // this API every few seconds or minutes, this won't be a huge problem.
-    // However, if you have a use case that would require 2 intervening
-    // calls to this be 30 minutes apart, you might want to leverage a RTC
-    // clock instead of the simple ticker here, or call TimeService::reset()
-    // before making an API call to sync current time.
-    return _timer.read_ms();
+    return (unsigned long) read_ms64();
   }
 private:
   Timer _timer;
+  uint32_t _last_us;
+  uint64_t _elapsed_us;
 };
 
+// Atomically sets *+ptr+ to +desired+ if it holds +expected+, returns true
+// if it did. Acts as a full memory barrier.
+static inline bool m2x_atomic_cas(volatile uint32_t* ptr, uint32_t expected, uint32_t desired) {
+#if defined(__CORTEX_M) && (__CORTEX_M >= 3)
+  __DMB();
+  do {
+    if (__LDREXW(ptr) != expected) {
+      __CLREX();
+      return false;
+    }
+  } while (__STREXW(desired, ptr) != 0);
+  __DMB();
+  return true;
+#else
+  /* Cortex-M0 has no exclusive access instructions, mask interrupts */
+  uint32_t primask = __get_PRIMASK();
+  bool swapped = false;
+
+  __disable_irq();
+  if (*ptr == expected) {
+    *ptr = desired;
+    swapped = true;
+  }
+  __set_PRIMASK(primask);
+  return swapped;
+#endif
+}
+
+static inline void m2x_memory_barrier() {
+  __DMB();
+}
+
 #include "TCPSocketConnection.h"
 
 #include <stddef.h>
@@ -47,139 +94,70 @@ void delay(int ms)
   wait_ms(ms);
 }
 
-char* strdup(const char* s)
-{
-  char* ret = (char*) malloc(strlen(s) + 1);
-  if (ret == NULL) { return ret;}
-  return strcpy(ret, s);
-}
-
 #ifdef __cplusplus
 }
 #endif
 
-class Print {
-public:
-  size_t print(const char* s);
-  size_t print(char c);
-  size_t print(int n);
-  size_t print(long n);
-  size_t print(double n, int digits = 2);
-
-  size_t println(const char* s);
-  size_t println(char c);
-  size_t println(int n);
-  size_t println(long n);
-  size_t println(double n, int digits = 2);
-  size_t println();
-
-  virtual size_t write(uint8_t c) = 0;
-  virtual size_t write(const uint8_t* buf, size_t size);
-};
-
-size_t Print::write(const uint8_t* buf, size_t size) {
-  size_t ret = 0;
-  while (size--) {
-    ret += write(*buf++);
-  }
-  return ret;
-}
-
-size_t Print::print(const char* s) {
-  return write((const uint8_t*)s, strlen(s));
-}
-
-size_t Print::print(char c) {
-  return write(c);
-}
-
-size_t Print::print(int n) {
-  return print((long) n);
-}
-
-size_t Print::print(long n) {
-  char buf[8 * sizeof(long) + 1];
-  snprintf(buf, sizeof(buf), "%ld", n);
-  return print(buf);
-}
-
-// Digits are ignored for now
-size_t Print::print(double n, int digits) {
-  char buf[65];
-  snprintf(buf, sizeof(buf), "%g", n);
-  return print(buf);
-}
-
-size_t Print::println(const char* s) {
-  return print(s) + println();
-}
-
-size_t Print::println(char c) {
-  return print(c) + println();
-}
-
-size_t Print::println(int n) {
-  return print(n) + println();
-}
-
-size_t Print::println(long n) {
-  return print(n) + println();
-}
-
-size_t Print::println(double n, int digits) {
-  return print(n, digits) + println();
-}
-
-size_t Print::println() {
-  return print('\r') + print('\n');
-}
+#include "m2x-client.h"
 
 /*
  * TCP Client
+ *
+ * +IN_SIZE+ and +OUT_SIZE+ set the capacity of the input and output buffers.
+ * Data is sent whenever the output buffer fills up, so boards with RAM to
+ * spare can size it to the MTU to send a whole request in one go.
  */
-class Client : public Print {
+template <size_t IN_SIZE = M2X_CLIENT_BUFFER_SIZE, size_t OUT_SIZE = IN_SIZE>
+class TCPClient : public Client {
 public:
-  Client();
-  ~Client();
+  TCPClient();
+  ~TCPClient();
 
   virtual int connect(const char *host, uint16_t port);
   virtual size_t write(uint8_t);
   virtual size_t write(const uint8_t *buf, size_t size);
   virtual int available();
+  virtual int availableNow();
   virtual int read();
+  virtual int read(uint8_t *buf, size_t size);
   virtual void flush();
   virtual void stop();
   virtual uint8_t connected();
 private:
-  virtual int read(uint8_t *buf, size_t size);
   void _fillin(void);
-  uint8_t _inbuf[128];
-  uint8_t _incnt;
+  M2XRingBuffer<IN_SIZE> _inbuf;
   void _flushout(void);
-  uint8_t _outbuf[128];
-  uint8_t _outcnt;
+  uint8_t _outbuf[OUT_SIZE];
+  size_t _outcnt;
   TCPSocketConnection _sock;
 };
 
-Client::Client() : _incnt(0), _outcnt(0), _sock() {
-    _sock.set_blocking(false, 1500);
+template <size_t IN_SIZE, size_t OUT_SIZE>
+TCPClient<IN_SIZE, OUT_SIZE>::TCPClient() : _inbuf(), _outcnt(0), _sock() {
+    _sock.set_blocking(false, M2X_MBED_SOCKET_TIMEOUT_MS);
 }
 
-Client::~Client() {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+TCPClient<IN_SIZE, OUT_SIZE>::~TCPClient() {
 }
 
-int Client::connect(const char *host, uint16_t port) {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::connect(const char *host, uint16_t port) {
+  _inbuf.clear();
+  _outcnt = 0;
   return _sock.connect(host, port) == 0;
 }
 
-size_t Client::write(uint8_t b) {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+size_t TCPClient<IN_SIZE, OUT_SIZE>::write(uint8_t b) {
   return write(&b, 1);
 }
 
-size_t Client::write(const uint8_t *buf, size_t size) {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+size_t TCPClient<IN_SIZE, OUT_SIZE>::write(const uint8_t *buf, size_t size) {
   size_t cnt = 0;
   while (size) {
-    int tmp = sizeof(_outbuf) - _outcnt;
+    size_t tmp = OUT_SIZE - _outcnt;
     if (tmp > size) tmp = size;
     memcpy(_outbuf + _outcnt, buf, tmp);
     _outcnt += tmp;
@@ -187,13 +165,14 @@ size_t Client::write(const uint8_t *buf, size_t size) {
     size -= tmp;
     cnt += tmp;
     // if no space flush it
-    if (_outcnt == sizeof(_outbuf))
+    if (_outcnt == OUT_SIZE)
         _flushout();
   }
   return cnt;
 }
 
-void Client::_flushout(void)
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::_flushout(void)
 {
   if (_outcnt > 0) {
     // NOTE: we know it's dangerous to cast from (const uint8_t *) to (char *),
@@ -206,48 +185,63 @@ void Client::_flushout(void)
   }
 }
 
-void Client::_fillin(void)
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::_fillin(void)
 {
-  int tmp = sizeof(_inbuf) - _incnt;
-  if (tmp) {
-    tmp = _sock.receive_all((char*)_inbuf + _incnt, tmp);
+  size_t length;
+  uint8_t* tail = _inbuf.tail(&length);
+  if (length) {
+    // Unlike receive_all(), receive() returns as soon as some data arrives
+    // instead of waiting for the whole free space to fill up.
+    int tmp = _sock.receive((char*) tail, length);
     if (tmp > 0)
-      _incnt += tmp;
+      _inbuf.commit(tmp);
   }
 }
 
-void Client::flush() {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::flush() {
   _flushout();
 }
 
-int Client::available() {
-  if (_incnt == 0) {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::available() {
+  if (_inbuf.size() == 0) {
+    _flushout();
+    _fillin();
+  }
+  return _inbuf.size();
+}
+
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::availableNow() {
+  if (_inbuf.size() == 0) {
     _flushout();
+    /* Only look at what the stack already received */
+    _sock.set_blocking(false, 0);
     _fillin();
+    _sock.set_blocking(false, M2X_MBED_SOCKET_TIMEOUT_MS);
   }
-  return (_incnt > 0) ? 1 : 0;
+  return _inbuf.size();
 }
 
-int Client::read() {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::read() {
   uint8_t ch;
   return (read(&ch, 1) == 1) ? ch : -1;
 }
 
-int Client::read(uint8_t *buf, size_t size) {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+int TCPClient<IN_SIZE, OUT_SIZE>::read(uint8_t *buf, size_t size) {
   int cnt = 0;
   while (size) {
     // need more
-    if (size > _incnt) {
+    if (size > _inbuf.size()) {
       _flushout();
       _fillin();
     }
-    if (_incnt > 0) {
-      int tmp = _incnt;
-      if (tmp > size) tmp = size;
-      memcpy(buf, _inbuf, tmp);
-      if (tmp != _incnt)
-          memmove(_inbuf, _inbuf + tmp, _incnt - tmp);
-      _incnt -= tmp;
+    if (_inbuf.size() > 0) {
+      size_t tmp = _inbuf.read(buf, size);
       size -= tmp;
       buf += tmp;
       cnt += tmp;
@@ -257,10 +251,14 @@ int Client::read(uint8_t *buf, size_t size) {
   return cnt;
 }
 
-void Client::stop() {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+void TCPClient<IN_SIZE, OUT_SIZE>::stop() {
   _sock.close();
+  _inbuf.clear();
+  _outcnt = 0;
 }
 
-uint8_t Client::connected() {
+template <size_t IN_SIZE, size_t OUT_SIZE>
+uint8_t TCPClient<IN_SIZE, OUT_SIZE>::connected() {
   return _sock.is_connected() ? 1 : 0;
 }
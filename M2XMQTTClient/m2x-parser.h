@@ -0,0 +1,328 @@
+#ifndef M2X_PARSER_H_
+#define M2X_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "m2x-config.h"
+
+/* Keys of the response envelope the parser looks for */
+static const char M2X_KEY_ID[] = "id";
+static const char M2X_KEY_STATUS[] = "status";
+
+/* Return values of M2XPacketParser::feed */
+static const int M2X_PARSE_MORE = 0;
+static const int M2X_PARSE_DONE = 1;
+static const int M2X_PARSE_ERROR = -1;
+
+/*
+ * Resumable parser for the MQTT packets sent by the M2X server
+ *
+ * Bytes can be fed in chunks of any size as they arrive, the parser keeps
+ * its position between calls so nothing ever has to wait for the rest of a
+ * packet. For each packet, the first bytes of the variable header are kept
+ * in +header+, which holds the return code of CONNACK and the packet
+ * identifier of PUBACK and SUBACK. PUBLISH payloads are scanned for the
+ * top level "id" and "status" fields of the M2X response envelope, the rest
+ * of the JSON is skipped without being stored unless a message buffer was
+ * given. The last segment of the topic of a PUBLISH is kept in
+ * +message_type+.
+ */
+class M2XPacketParser {
+public:
+  M2XPacketParser() : _message(NULL), _message_size(0) { reset(); }
+
+  void reset();
+
+  // Number of bytes that can be fed without reading past the end of the
+  // current packet
+  size_t wanted() const;
+
+  // Consumes +length+ bytes, which must not exceed wanted(). Returns
+  // M2X_PARSE_DONE when they complete a packet, M2X_PARSE_MORE if more
+  // bytes are needed, or M2X_PARSE_ERROR if the stream is malformed.
+  int feed(const uint8_t* data, size_t length);
+
+  uint8_t type() const { return flags >> 4; }
+
+  // Copies the payload of each PUBLISH into +buffer+, NUL terminated, up to
+  // +size+ - 1 bytes. Pass NULL to stop copying.
+  void setMessageBuffer(char* buffer, size_t size) {
+    _message = buffer;
+    _message_size = buffer ? size - 1 : 0;
+  }
+
+  // Fields of the last parsed packet
+  uint8_t flags;
+  /* Large enough for a SUBACK granting every topic we subscribe to */
+  uint8_t header[3 + M2X_MAX_MESSAGE_HANDLERS];
+  uint8_t header_length;
+  uint16_t packet_id;
+  int16_t response_id;
+  int16_t response_status;
+  // Last segment of the topic, NUL terminated. Longer segments are cut and
+  // message_type_length is then M2X_MESSAGE_TYPE_SIZE + 1.
+  char message_type[M2X_MESSAGE_TYPE_SIZE + 1];
+  uint8_t message_type_length;
+  // Length of the payload, which may exceed what the message buffer holds
+  size_t message_length;
+
+private:
+  uint8_t _state;
+  uint8_t _count;
+  uint32_t _remaining;
+  uint32_t _value;
+
+  /* JSON scanner state */
+  uint8_t _depth;
+  bool _in_string;
+  bool _escape;
+  bool _in_value;
+  bool _has_digits;
+  uint8_t _field;
+  uint8_t _key_length;
+  /* Long enough for the longest key looked for, longer keys are only
+   * counted */
+  char _key[sizeof(M2X_KEY_STATUS) - 1];
+  int32_t _number;
+
+  char* _message;
+  size_t _message_size;
+
+  void beginBody();
+  void scanJson(uint8_t c);
+  void endValue();
+};
+
+/* Parser states */
+static const uint8_t M2X_PARSER_TYPE = 0;
+static const uint8_t M2X_PARSER_LENGTH = 1;
+static const uint8_t M2X_PARSER_TOPIC_LENGTH = 2;
+static const uint8_t M2X_PARSER_TOPIC = 3;
+static const uint8_t M2X_PARSER_PACKET_ID = 4;
+static const uint8_t M2X_PARSER_JSON = 5;
+static const uint8_t M2X_PARSER_HEADER = 6;
+
+/* Response envelope fields */
+static const uint8_t M2X_FIELD_NONE = 0;
+static const uint8_t M2X_FIELD_ID = 1;
+static const uint8_t M2X_FIELD_STATUS = 2;
+
+void M2XPacketParser::reset() {
+  _state = M2X_PARSER_TYPE;
+  _count = 0;
+  _remaining = 0;
+  _value = 0;
+  flags = 0;
+  header_length = 0;
+  packet_id = 0;
+  response_id = -1;
+  response_status = 0;
+  message_type[0] = '\0';
+  message_type_length = 0;
+  message_length = 0;
+}
+
+size_t M2XPacketParser::wanted() const {
+  if (_state == M2X_PARSER_TYPE || _state == M2X_PARSER_LENGTH) { return 1; }
+  return _remaining;
+}
+
+// Called once the remaining length is known
+void M2XPacketParser::beginBody() {
+  _count = 0;
+  _value = 0;
+  header_length = 0;
+  packet_id = 0;
+  response_id = -1;
+  response_status = 0;
+  message_type[0] = '\0';
+  message_type_length = 0;
+  message_length = 0;
+  if (_message) { _message[0] = '\0'; }
+  if (type() == MMQTT_MESSAGE_TYPE_PUBLISH) {
+    _state = M2X_PARSER_TOPIC_LENGTH;
+    _depth = 0;
+    _in_string = _escape = _in_value = _has_digits = false;
+    _field = M2X_FIELD_NONE;
+    _key_length = 0;
+    _number = 0;
+  } else {
+    _state = M2X_PARSER_HEADER;
+  }
+}
+
+int M2XPacketParser::feed(const uint8_t* data, size_t length) {
+  const uint8_t* end = data + length;
+  size_t skip;
+
+  while (data < end) {
+    switch (_state) {
+      case M2X_PARSER_TYPE:
+        flags = *data++;
+        _state = M2X_PARSER_LENGTH;
+        _count = 0;
+        _value = 0;
+        continue;
+      case M2X_PARSER_LENGTH:
+        _value |= (uint32_t) (*data & 0x7F) << (7 * _count++);
+        if (*data++ & 0x80) {
+          if (_count == 4) { return M2X_PARSE_ERROR; }
+          continue;
+        }
+        _remaining = _value;
+        beginBody();
+        if (_remaining == 0) {
+          _state = M2X_PARSER_TYPE;
+          return (data == end) ? M2X_PARSE_DONE : M2X_PARSE_ERROR;
+        }
+        continue;
+      default:
+        break;
+    }
+
+    /* Everything below is part of the packet body */
+    switch (_state) {
+      case M2X_PARSER_TOPIC_LENGTH:
+        _value = (_value << 8) | *data++;
+        _remaining--;
+        if (++_count == 2) {
+          if (_value > _remaining) { return M2X_PARSE_ERROR; }
+          _state = M2X_PARSER_TOPIC;
+        }
+        break;
+      case M2X_PARSER_TOPIC:
+        /* Only the part after the last slash is kept */
+        while (data < end && _value > 0) {
+          if (*data == '/') {
+            message_type[0] = '\0';
+            message_type_length = 0;
+          } else if (message_type_length <= M2X_MESSAGE_TYPE_SIZE) {
+            if (message_type_length < M2X_MESSAGE_TYPE_SIZE) {
+              message_type[message_type_length] = *data;
+              message_type[message_type_length + 1] = '\0';
+            }
+            message_type_length++;
+          }
+          data++;
+          _remaining--;
+          _value--;
+        }
+        break;
+      case M2X_PARSER_PACKET_ID:
+        packet_id = (packet_id << 8) | *data++;
+        _remaining--;
+        if (++_count == 2) { _state = M2X_PARSER_JSON; }
+        break;
+      case M2X_PARSER_JSON:
+        while (data < end && _remaining > 0) {
+          if (message_length < _message_size) {
+            _message[message_length] = *data;
+            _message[message_length + 1] = '\0';
+          }
+          message_length++;
+          scanJson(*data++);
+          _remaining--;
+        }
+        break;
+      case M2X_PARSER_HEADER:
+        if (header_length < sizeof(header)) {
+          header[header_length++] = *data++;
+          _remaining--;
+        } else {
+          skip = end - data;
+          if (skip > _remaining) { skip = _remaining; }
+          data += skip;
+          _remaining -= skip;
+        }
+        if (header_length == 2 && _count == 0) {
+          packet_id = ((uint16_t) header[0] << 8) | header[1];
+          _count = 1;
+        }
+        break;
+    }
+    if (_state == M2X_PARSER_TOPIC && _value == 0) {
+      _count = 0;
+      _state = (flags & 0x06) ? M2X_PARSER_PACKET_ID : M2X_PARSER_JSON;
+    }
+    if (_remaining == 0) {
+      if (_state == M2X_PARSER_JSON && _in_value) { endValue(); }
+      _state = M2X_PARSER_TYPE;
+      return (data == end) ? M2X_PARSE_DONE : M2X_PARSE_ERROR;
+    }
+  }
+  return M2X_PARSE_MORE;
+}
+
+// Stores the value just scanned if it belongs to a field we look for
+void M2XPacketParser::endValue() {
+  if (_has_digits) {
+    if (_field == M2X_FIELD_ID) {
+      response_id = (int16_t) _number;
+    } else if (_field == M2X_FIELD_STATUS) {
+      response_status = (int16_t) _number;
+    }
+  }
+  _in_value = false;
+}
+
+// Advances the JSON scanner by one character. Only the structure of the
+// outermost object is tracked, nested values are skipped by depth.
+void M2XPacketParser::scanJson(uint8_t c) {
+  if (_in_string) {
+    if (_escape) {
+      _escape = false;
+    } else if (c == '\\') {
+      _escape = true;
+      return;
+    } else if (c == '"') {
+      _in_string = false;
+      return;
+    }
+    if (_depth != 1) { return; }
+    if (!_in_value) {
+      /* Key characters, longer keys can't match the ones we want */
+      if (_key_length < sizeof(_key)) { _key[_key_length] = c; }
+      if (_key_length < 0xFF) { _key_length++; }
+      return;
+    }
+  } else if (c == '"') {
+    _in_string = true;
+    if (_depth == 1 && !_in_value) { _key_length = 0; }
+    return;
+  } else if (c == '{' || c == '[') {
+    _depth++;
+    return;
+  } else if (c == '}' || c == ']') {
+    if (_depth == 1 && _in_value) { endValue(); }
+    if (_depth > 0) { _depth--; }
+    return;
+  } else if (_depth != 1) {
+    return;
+  } else if (c == ':') {
+    _in_value = true;
+    _has_digits = false;
+    _number = 0;
+    if (_key_length == sizeof(M2X_KEY_ID) - 1 &&
+        memcmp(_key, M2X_KEY_ID, sizeof(M2X_KEY_ID) - 1) == 0) {
+      _field = M2X_FIELD_ID;
+    } else if (_key_length == sizeof(M2X_KEY_STATUS) - 1 &&
+               memcmp(_key, M2X_KEY_STATUS, sizeof(M2X_KEY_STATUS) - 1) == 0) {
+      _field = M2X_FIELD_STATUS;
+    } else {
+      _field = M2X_FIELD_NONE;
+    }
+    return;
+  } else if (c == ',') {
+    endValue();
+    return;
+  }
+  /* Value characters, the ID is sent as a string holding a number */
+  if (_field != M2X_FIELD_NONE && c >= '0' && c <= '9' && _number < 100000) {
+    _number = _number * 10 + (c - '0');
+    _has_digits = true;
+  }
+}
+
+#endif  /* M2X_PARSER_H_ */
@@ -0,0 +1,587 @@
+#ifndef M2X_PRINT_H_
+#define M2X_PRINT_H_
+
+/*
+ * Arduino style Print class shared by all platforms
+ */
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Number formatting without printf
+ *
+ * These write the text form of a number into +buf+ without a terminating
+ * NUL and return its length. Keeping printf out of the request path also
+ * keeps newlib's floating point printf support out of the firmware.
+ */
+
+/* Large enough for any number rendered by the functions below */
+#define M2X_NUMBER_BUFFER_SIZE 32
+
+static const char M2X_DIGIT_PAIRS[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static const double M2X_POW10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Number of decimal digits in +n+
+static inline size_t m2x_uint64_length(uint64_t n) {
+  size_t length = 1;
+  while (n >= 10000) { n /= 10000; length += 4; }
+  while (n >= 10) { n /= 10; length++; }
+  return length;
+}
+
+static inline size_t m2x_format_uint64(char* buf, uint64_t n) {
+  size_t length = m2x_uint64_length(n);
+  char* p = buf + length;
+  while (n >= 100) {
+    const char* pair = M2X_DIGIT_PAIRS + (n % 100) * 2;
+    n /= 100;
+    *--p = pair[1];
+    *--p = pair[0];
+  }
+  if (n >= 10) {
+    *--p = M2X_DIGIT_PAIRS[n * 2 + 1];
+    *--p = M2X_DIGIT_PAIRS[n * 2];
+  } else {
+    *--p = (char) ('0' + n);
+  }
+  return length;
+}
+
+static inline size_t m2x_long_length(long n) {
+  return (n < 0) ? m2x_uint64_length(0 - (uint64_t) n) + 1 :
+      m2x_uint64_length((uint64_t) n);
+}
+
+static inline size_t m2x_format_long(char* buf, long n) {
+  if (n < 0) {
+    buf[0] = '-';
+    return m2x_format_uint64(buf + 1, 0 - (uint64_t) n) + 1;
+  }
+  return m2x_format_uint64(buf, (uint64_t) n);
+}
+
+// Returns +a+ * 10^+k+
+static inline double m2x_scale10(double a, int k) {
+  while (k > 22) { a *= 1e22; k -= 22; }
+  while (k < -22) { a /= 1e22; k += 22; }
+  return (k >= 0) ? a * M2X_POW10[k] : a / M2X_POW10[-k];
+}
+
+// Writes +m+ * 10^-+k+ in plain or exponent notation
+static inline size_t m2x_format_decimal(char* buf, uint64_t m, int k) {
+  char mantissa[M2X_NUMBER_BUFFER_SIZE];
+  size_t length = 0, ndigits;
+  int point, exponent, i;
+
+  while (m != 0 && m % 10 == 0) {
+    m /= 10;
+    k--;
+  }
+  ndigits = m2x_format_uint64(mantissa, m);
+  point = (int) ndigits - k;
+  exponent = point - 1;
+  if (exponent < -5 || exponent >= 17) {
+    buf[length++] = mantissa[0];
+    if (ndigits > 1) {
+      buf[length++] = '.';
+      memcpy(buf + length, mantissa + 1, ndigits - 1);
+      length += ndigits - 1;
+    }
+    buf[length++] = 'e';
+    if (exponent < 0) {
+      buf[length++] = '-';
+      exponent = -exponent;
+    }
+    length += m2x_format_uint64(buf + length, exponent);
+  } else if (point <= 0) {
+    buf[length++] = '0';
+    buf[length++] = '.';
+    for (i = point; i < 0; i++) { buf[length++] = '0'; }
+    memcpy(buf + length, mantissa, ndigits);
+    length += ndigits;
+  } else if (point >= (int) ndigits) {
+    memcpy(buf + length, mantissa, ndigits);
+    length += ndigits;
+    for (i = ndigits; i < point; i++) { buf[length++] = '0'; }
+  } else {
+    memcpy(buf + length, mantissa, point);
+    length += point;
+    buf[length++] = '.';
+    memcpy(buf + length, mantissa + point, ndigits - point);
+    length += ndigits - point;
+  }
+  return length;
+}
+
+/*
+ * Exact comparison of decimal and binary numbers
+ *
+ * Checking that a decimal reads back as a given double takes more precision
+ * than a double has once the mantissa or the power of ten aren't exact
+ * doubles. Rather than parsing the decimal with strtod, which would link
+ * newlib's floating point support back in, both sides are compared as
+ * integers. 1280 bits cover the largest products, 5^340 times a 57 bit
+ * mantissa for the smallest subnormals.
+ */
+#define M2X_BIGNUM_LIMBS 40
+
+struct M2XBignum {
+  uint32_t limbs[M2X_BIGNUM_LIMBS];
+  int length;
+};
+
+static inline void m2x_bignum_set(M2XBignum* a, uint64_t v) {
+  a->length = 0;
+  while (v != 0) {
+    a->limbs[a->length++] = (uint32_t) v;
+    v >>= 32;
+  }
+}
+
+static inline void m2x_bignum_mul(M2XBignum* a, uint32_t v) {
+  uint64_t carry = 0;
+  int i;
+
+  for (i = 0; i < a->length; i++) {
+    carry += (uint64_t) a->limbs[i] * v;
+    a->limbs[i] = (uint32_t) carry;
+    carry >>= 32;
+  }
+  if (carry != 0 && a->length < M2X_BIGNUM_LIMBS) { a->limbs[a->length++] = (uint32_t) carry; }
+}
+
+static inline void m2x_bignum_mul_pow5(M2XBignum* a, int exponent) {
+  /* 5^13 is the largest power of 5 that fits in a limb */
+  for (; exponent >= 13; exponent -= 13) { m2x_bignum_mul(a, 1220703125); }
+  for (; exponent > 0; exponent--) { m2x_bignum_mul(a, 5); }
+}
+
+static inline void m2x_bignum_shift(M2XBignum* a, int bits) {
+  int words = bits / 32, i;
+
+  bits %= 32;
+  if (a->length == 0 || (words == 0 && bits == 0)) { return; }
+  if (a->length + words + 1 > M2X_BIGNUM_LIMBS) { words = M2X_BIGNUM_LIMBS - a->length - 1; }
+  a->limbs[a->length + words] = 0;
+  for (i = a->length - 1; i >= 0; i--) {
+    if (bits != 0) { a->limbs[i + words + 1] |= a->limbs[i] >> (32 - bits); }
+    a->limbs[i + words] = a->limbs[i] << bits;
+  }
+  for (i = 0; i < words; i++) { a->limbs[i] = 0; }
+  a->length += words + 1;
+  while (a->length > 0 && a->limbs[a->length - 1] == 0) { a->length--; }
+}
+
+static inline int m2x_bignum_compare(const M2XBignum* a, const M2XBignum* b) {
+  int i;
+
+  if (a->length != b->length) { return a->length < b->length ? -1 : 1; }
+  for (i = a->length - 1; i >= 0; i--) {
+    if (a->limbs[i] != b->limbs[i]) { return a->limbs[i] < b->limbs[i] ? -1 : 1; }
+  }
+  return 0;
+}
+
+// Compares +m+ * 10^-+k+ with +f+ * 2^+e+, returns a negative number, 0 or
+// a positive number like strcmp
+static inline int m2x_compare_decimal(uint64_t m, int k, uint64_t f, int e) {
+  M2XBignum a, b;
+  int twos = -k - e;
+
+  /* m * 5^-k * 2^-k against f * 2^e, with the factors moved to the side
+   * where their exponent is positive */
+  m2x_bignum_set(&a, m);
+  m2x_bignum_set(&b, f);
+  if (k < 0) {
+    m2x_bignum_mul_pow5(&a, -k);
+  } else {
+    m2x_bignum_mul_pow5(&b, k);
+  }
+  if (twos > 0) {
+    m2x_bignum_shift(&a, twos);
+  } else {
+    m2x_bignum_shift(&b, -twos);
+  }
+  return m2x_bignum_compare(&a, &b);
+}
+
+// Splits +n+ into +f+ * 2^+e+, with +f+ holding the 53 bits of a double or,
+// if +single+ is true, the 24 bits of a float
+static inline void m2x_split_double(double n, bool single, uint64_t* f, int* e) {
+  uint64_t bits;
+  uint32_t single_bits;
+  float single_n;
+  int exponent;
+
+  if (single) {
+    single_n = (float) n;
+    memcpy(&single_bits, &single_n, sizeof(single_bits));
+    exponent = (single_bits >> 23) & 0xFF;
+    *f = single_bits & 0x7FFFFF;
+    /* Subnormals lack the implicit leading bit */
+    if (exponent != 0) { *f |= (uint64_t) 1 << 23; }
+    *e = (exponent != 0) ? exponent - 150 : -149;
+  } else {
+    memcpy(&bits, &n, sizeof(bits));
+    exponent = (int) ((bits >> 52) & 0x7FF);
+    *f = bits & (((uint64_t) 1 << 52) - 1);
+    if (exponent != 0) { *f |= (uint64_t) 1 << 52; }
+    *e = (exponent != 0) ? exponent - 1075 : -1074;
+  }
+}
+
+// Returns true if +r+ lies half way between two floats, so that rounding it
+// to float may differ from rounding the decimal it came from directly.
+// Values out of the normal float range count as well.
+static inline bool m2x_float_midpoint(double r) {
+  uint64_t bits;
+
+  r = fabs(r);
+  if (!(r >= 1.1754943508222875e-38 && r <= 3.4028234663852886e38)) { return true; }
+  /* Of the 29 mantissa bits a double has beyond a float's, a midpoint only
+   * sets the highest */
+  memcpy(&bits, &r, sizeof(bits));
+  return (bits & 0x1FFFFFFF) == 0x10000000;
+}
+
+// Returns true if +m+ * 10^-+k+ reads back as exactly +n+, or as the same
+// float if +single+ is true
+static inline bool m2x_reads_back(uint64_t m, int k, double n, bool single) {
+  uint64_t f;
+  double r;
+  int e, upper, lower;
+
+  /* When both m and 10^k are exact doubles one IEEE operation gives the
+   * correctly rounded result, the same value a decimal parser produces */
+  if (m < ((uint64_t) 1 << 53) && k >= -22 && k <= 22) {
+    r = (k >= 0) ? (double) m / M2X_POW10[k] : (double) m * M2X_POW10[-k];
+    if (!single) { return r == n; }
+    /* Rounding to double and then to float only differs from rounding to
+     * float directly when r lands half way between two floats */
+    if (!m2x_float_midpoint(r)) { return (float) r == (float) n; }
+  }
+  /* Anything strictly between the half way points to the neighbours of n
+   * reads back as n, and the half way points themselves if n is even */
+  m2x_split_double(n, single, &f, &e);
+  upper = m2x_compare_decimal(m, k, 2 * f + 1, e - 1);
+  if (upper > 0 || (upper == 0 && (f & 1))) { return false; }
+  if (f == ((uint64_t) 1 << (single ? 23 : 52)) && e > (single ? -149 : -1074)) {
+    /* The neighbour below a power of two is closer */
+    lower = m2x_compare_decimal(m, k, 4 * f - 1, e - 2);
+  } else {
+    lower = m2x_compare_decimal(m, k, 2 * f - 1, e - 1);
+  }
+  return lower > 0 || (lower == 0 && !(f & 1));
+}
+
+// Returns +n+ * 10^+k+ rounded to the nearest integer, starting from the
+// estimate +m+
+static inline uint64_t m2x_nearest_mantissa(double n, int k, uint64_t m) {
+  uint64_t f, low, high, mid, step = 1;
+  int e;
+
+  /* Finds the smallest m whose half way point to m + 1, (2m + 1) * 10^-k / 2,
+   * is at or above n */
+  m2x_split_double(n, false, &f, &e);
+  if (m2x_compare_decimal(2 * m + 1, k, f, e + 1) < 0) {
+    do {
+      low = m;
+      m += step;
+      step *= 2;
+    } while (m2x_compare_decimal(2 * m + 1, k, f, e + 1) < 0);
+    high = m;
+  } else {
+    do {
+      high = m;
+      m = (m > step) ? m - step : 0;
+      step *= 2;
+    } while (m > 0 && m2x_compare_decimal(2 * m + 1, k, f, e + 1) >= 0);
+    low = m;
+    if (low == 0 && m2x_compare_decimal(1, k, f, e + 1) >= 0) { return 0; }
+  }
+  while (high - low > 1) {
+    mid = low + (high - low) / 2;
+    if (m2x_compare_decimal(2 * mid + 1, k, f, e + 1) < 0) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return high;
+}
+
+// Rounds the 17 digit mantissa +m17+ to +p+ digits and stores the result in
+// +m+. Returns true if it reads back as +n+ with exponent +k+.
+static inline bool m2x_round_digits(double n, uint64_t m17, int p, int k, bool single,
+                             uint64_t* m) {
+  uint64_t d = (uint64_t) M2X_POW10[17 - p];
+
+  *m = (m17 + d / 2) / d;
+  if (m2x_reads_back(*m, k, n, single)) { return true; }
+  /* Rounding twice may land on the wrong side of .5, so the neighbours on
+   * both sides are tried */
+  *m = (m17 + d / 2) / d + 1;
+  if (m2x_reads_back(*m, k, n, single)) { return true; }
+  *m = (m17 + d / 2) / d - 1;
+  if (m2x_reads_back(*m, k, n, single)) { return true; }
+  *m = (m17 + d / 2) / d;
+  return false;
+}
+
+// Renders +n+ using the fewest significant digits that still read back as
+// exactly the same value, or as the same float if +single+ is true. At most
+// +digits+ significant digits are used, so a smaller value rounds +n+ to
+// that precision. Large and tiny numbers use exponent notation.
+//
+// The number of significant digits used is stored in +precision+ if given.
+// Rendering the same value again with that precision passed back in skips
+// the search for the shortest form, and yields text of the same length.
+static inline size_t m2x_format_double(char* buf, double n, int digits, bool single = false,
+                                       int* precision = NULL) {
+  uint64_t m17, m, best;
+  int e10, k, low, high, mid, p;
+  size_t length = 0;
+
+  if (n != n) {
+    memcpy(buf, "nan", 3);
+    return 3;
+  }
+  if (n < 0) {
+    buf[length++] = '-';
+    n = -n;
+  }
+  if (n > 1.7976931348623157e308) {
+    memcpy(buf + length, "inf", 3);
+    return length + 3;
+  }
+  if (n == 0) {
+    buf[0] = '0';
+    return 1;
+  }
+  if (digits < 1) { digits = 1; }
+  if (digits > 17) { digits = 17; }
+
+  e10 = (int) floor(log10(n));
+  k = 16 - e10;
+  m17 = (uint64_t) (m2x_scale10(n, k) + 0.5);
+  if ((double) m17 >= 1e17) {
+    k--;
+    m17 = (uint64_t) (m2x_scale10(n, k) + 0.5);
+  } else if ((double) m17 < 1e16) {
+    k++;
+    m17 = (uint64_t) (m2x_scale10(n, k) + 0.5);
+  }
+  /* The estimate takes several inexact steps for large exponents and can
+   * miss by dozens of units. Floats need at most 9 digits, which rounding
+   * to a neighbour covers, but doubles need m17 itself to read back. */
+  if (!single) {
+    m17 = m2x_nearest_mantissa(n, k, m17);
+    if (m17 >= 100000000000000000ULL) {
+      k--;
+      m17 = m2x_nearest_mantissa(n, k, m17 / 10);
+    } else if (m17 < 10000000000000000ULL) {
+      k++;
+      m17 = m2x_nearest_mantissa(n, k, m17 * 10);
+    }
+    if (m17 == 100000000000000000ULL) {
+      k--;
+      m17 /= 10;
+    }
+  }
+  best = m17;
+
+  p = precision ? *precision : 0;
+  if (p > 0 && p < 17 && m2x_round_digits(n, m17, p, k - 17 + p, single, &m) &&
+      m % 10 != 0 && (double) m < M2X_POW10[p]) {
+    /* Trailing zeros or a carry into another digit would change the length */
+    return length + m2x_format_decimal(buf + length, m, k - 17 + p);
+  }
+
+  /* Binary search for the shortest mantissa that reads back as n */
+  low = 1;
+  high = digits;
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (m2x_round_digits(n, m17, mid, k - 17 + mid, single, &m)) {
+      high = mid;
+      best = m;
+    } else {
+      low = mid + 1;
+    }
+  }
+  if (high == digits && digits < 17) {
+    /* Either the shortest form or, with too few digits to read back as n,
+     * n rounded to +digits+ */
+    m2x_round_digits(n, m17, digits, k - 17 + digits, single, &best);
+  }
+  if (precision) { *precision = high; }
+  return length + m2x_format_decimal(buf + length, best, k - 17 + high);
+}
+
+// Renders +n+ rounded to +decimals+ places after the point, like Arduino's
+// Print does. Values too large for that fall back to m2x_format_double.
+static inline size_t m2x_format_fixed(char* buf, double n, int decimals) {
+  char mantissa[M2X_NUMBER_BUFFER_SIZE];
+  size_t length = 0, ndigits;
+  double scaled;
+  uint64_t m;
+  int i;
+
+  if (decimals < 0) { decimals = 0; }
+  if (decimals > 17) { decimals = 17; }
+  scaled = fabs(n) * M2X_POW10[decimals] + 0.5;
+  /* Also catches nan and inf */
+  if (!(scaled < 9e18)) { return m2x_format_double(buf, n, 17); }
+  m = (uint64_t) scaled;
+  if (n < 0 && m != 0) { buf[length++] = '-'; }
+  ndigits = m2x_format_uint64(mantissa, m);
+  if ((int) ndigits > decimals) {
+    memcpy(buf + length, mantissa, ndigits - decimals);
+    length += ndigits - decimals;
+  } else {
+    buf[length++] = '0';
+  }
+  if (decimals > 0) {
+    buf[length++] = '.';
+    for (i = ndigits; i < decimals; i++) { buf[length++] = '0'; }
+    if ((int) ndigits > decimals) {
+      memcpy(buf + length, mantissa + ndigits - decimals, decimals);
+      length += decimals;
+    } else {
+      memcpy(buf + length, mantissa, ndigits);
+      length += ndigits;
+    }
+  }
+  return length;
+}
+
+class Print {
+public:
+  size_t print(const char* s);
+  size_t print(char c);
+  size_t print(int n);
+  size_t print(long n);
+  // Floating point values are printed with the fewest digits that read back
+  // as the same value, or, given +digits+, rounded to that many decimal
+  // places like Arduino's Print.
+  size_t print(float n);
+  size_t print(double n);
+  size_t print(float n, int digits);
+  size_t print(double n, int digits);
+
+  size_t println(const char* s);
+  size_t println(char c);
+  size_t println(int n);
+  size_t println(long n);
+  size_t println(float n);
+  size_t println(double n);
+  size_t println(float n, int digits);
+  size_t println(double n, int digits);
+  size_t println();
+
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* buf, size_t size);
+
+protected:
+  // Renders the floating point values of print(float) and print(double),
+  // see m2x_format_double. A Print that renders the same values again can
+  // override it to reuse what the first rendering found.
+  virtual size_t formatDouble(char* buf, double n, int digits, bool single);
+};
+
+size_t Print::formatDouble(char* buf, double n, int digits, bool single) {
+  return m2x_format_double(buf, n, digits, single);
+}
+
+size_t Print::write(const uint8_t* buf, size_t size) {
+  size_t ret = 0;
+  while (size--) {
+    ret += write(*buf++);
+  }
+  return ret;
+}
+
+size_t Print::print(const char* s) {
+  return write((const uint8_t*)s, strlen(s));
+}
+
+size_t Print::print(char c) {
+  return write(c);
+}
+
+size_t Print::print(int n) {
+  return print((long) n);
+}
+
+size_t Print::print(long n) {
+  char buf[M2X_NUMBER_BUFFER_SIZE];
+  return write((const uint8_t*)buf, m2x_format_long(buf, n));
+}
+
+size_t Print::print(float n) {
+  char buf[M2X_NUMBER_BUFFER_SIZE];
+  return write((const uint8_t*)buf, formatDouble(buf, n, 9, true));
+}
+
+size_t Print::print(double n) {
+  char buf[M2X_NUMBER_BUFFER_SIZE];
+  return write((const uint8_t*)buf, formatDouble(buf, n, 17, false));
+}
+
+size_t Print::print(float n, int digits) {
+  return print((double) n, digits);
+}
+
+size_t Print::print(double n, int digits) {
+  char buf[M2X_NUMBER_BUFFER_SIZE];
+  return write((const uint8_t*)buf, m2x_format_fixed(buf, n, digits));
+}
+
+size_t Print::println(const char* s) {
+  return print(s) + println();
+}
+
+size_t Print::println(char c) {
+  return print(c) + println();
+}
+
+size_t Print::println(int n) {
+  return print(n) + println();
+}
+
+size_t Print::println(long n) {
+  return print(n) + println();
+}
+
+size_t Print::println(float n) {
+  return print(n) + println();
+}
+
+size_t Print::println(double n) {
+  return print(n) + println();
+}
+
+size_t Print::println(float n, int digits) {
+  return print(n, digits) + println();
+}
+
+size_t Print::println(double n, int digits) {
+  return print(n, digits) + println();
+}
+
+size_t Print::println() {
+  return print('\r') + print('\n');
+}
+
+#endif  /* M2X_PRINT_H_ */
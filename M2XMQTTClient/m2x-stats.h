@@ -0,0 +1,151 @@
+#ifndef M2X_STATS_H_
+#define M2X_STATS_H_
+
+/*
+ * Counters and latency histograms kept by M2XMQTTClient
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "m2x-config.h"
+#include "m2x-print.h"
+
+// Log bucketed histogram of times in milliseconds
+struct M2XHistogram {
+  uint32_t count;
+  uint32_t max_ms;
+  uint32_t buckets[M2X_HISTOGRAM_BUCKETS];
+
+  void add(unsigned long ms) {
+    int bucket = 0;
+
+    while (bucket < M2X_HISTOGRAM_BUCKETS - 1 && ms >= (1UL << bucket)) { bucket++; }
+    buckets[bucket]++;
+    count++;
+    if (ms > max_ms) { max_ms = ms; }
+  }
+};
+
+// Statistics of one client since it was created or resetStats() was called.
+// Counters wrap around once they overflow.
+struct M2XStats {
+  // Requests submitted and responses matched to one of them
+  uint32_t requests;
+  uint32_t responses;
+  // PINGRESP or CONNACK that didn't arrive within M2X_PING_TIMEOUT_MS
+  uint32_t timeouts;
+  // Requests completed with E_TIMEOUT after M2X_REQUEST_TIMEOUT_MS
+  uint32_t request_timeouts;
+  // PUBLISH packets that matched neither a pending request nor a message
+  // handler, e.g. responses arriving after their request failed
+  uint32_t unmatched;
+  // Connections made after the first one
+  uint32_t reconnects;
+  // Requests whose payload didn't fit in M2X_PAYLOAD_BUFFER_SIZE, so it was
+  // printed a second time straight into the MQTT stream
+  uint32_t two_pass;
+  // Connection attempts that failed, by the stage they were at: opening
+  // the TCP connection, waiting for CONNACK, or waiting for SUBACK
+  uint32_t tcp_failures;
+  uint32_t connack_failures;
+  uint32_t suback_failures;
+  uint32_t bytes_in;
+  uint32_t bytes_out;
+  // From opening the TCP connection to the end of the handshake
+  M2XHistogram connect_ms;
+  // From submitting a request to receiving its response
+  M2XHistogram round_trip_ms;
+};
+
+static inline size_t m2x_print_uint32(Print* print, uint32_t value) {
+  char buf[10];
+  int i = sizeof(buf);
+
+  do {
+    buf[--i] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  return print->write((const uint8_t *) buf + i, sizeof(buf) - i);
+}
+
+static inline size_t m2x_print_histogram(Print* print, const M2XHistogram* histogram) {
+  size_t bytes = 0;
+  int i, last;
+
+  bytes += print->print("{\"count\":");
+  bytes += m2x_print_uint32(print, histogram->count);
+  bytes += print->print(",\"max\":");
+  bytes += m2x_print_uint32(print, histogram->max_ms);
+  bytes += print->print(",\"buckets\":[");
+  /* Trailing empty buckets are left out */
+  for (last = M2X_HISTOGRAM_BUCKETS; last > 0 && histogram->buckets[last - 1] == 0; last--) ;
+  for (i = 0; i < last; i++) {
+    if (i > 0) { bytes += print->print(','); }
+    bytes += m2x_print_uint32(print, histogram->buckets[i]);
+  }
+  bytes += print->print("]}");
+  return bytes;
+}
+
+// Prints +stats+ as compact JSON
+static inline size_t m2x_print_stats(Print* print, const M2XStats* stats) {
+  size_t bytes = 0;
+
+  bytes += print->print("{\"requests\":");
+  bytes += m2x_print_uint32(print, stats->requests);
+  bytes += print->print(",\"responses\":");
+  bytes += m2x_print_uint32(print, stats->responses);
+  bytes += print->print(",\"timeouts\":");
+  bytes += m2x_print_uint32(print, stats->timeouts);
+  bytes += print->print(",\"request_timeouts\":");
+  bytes += m2x_print_uint32(print, stats->request_timeouts);
+  bytes += print->print(",\"unmatched\":");
+  bytes += m2x_print_uint32(print, stats->unmatched);
+  bytes += print->print(",\"reconnects\":");
+  bytes += m2x_print_uint32(print, stats->reconnects);
+  bytes += print->print(",\"two_pass\":");
+  bytes += m2x_print_uint32(print, stats->two_pass);
+  bytes += print->print(",\"failures\":{\"tcp\":");
+  bytes += m2x_print_uint32(print, stats->tcp_failures);
+  bytes += print->print(",\"connack\":");
+  bytes += m2x_print_uint32(print, stats->connack_failures);
+  bytes += print->print(",\"suback\":");
+  bytes += m2x_print_uint32(print, stats->suback_failures);
+  bytes += print->print("},\"bytes_in\":");
+  bytes += m2x_print_uint32(print, stats->bytes_in);
+  bytes += print->print(",\"bytes_out\":");
+  bytes += m2x_print_uint32(print, stats->bytes_out);
+  bytes += print->print(",\"connect_ms\":");
+  bytes += m2x_print_histogram(print, &stats->connect_ms);
+  bytes += print->print(",\"round_trip_ms\":");
+  bytes += m2x_print_histogram(print, &stats->round_trip_ms);
+  bytes += print->print('}');
+  return bytes;
+}
+
+// Print escaping what it prints as the contents of a JSON string
+class M2XJsonStringPrint : public Print {
+public:
+  Print* print;
+
+  virtual size_t write(uint8_t b) {
+    return write(&b, 1);
+  }
+
+  virtual size_t write(const uint8_t* buf, size_t size) {
+    size_t bytes = 0, start = 0, i;
+
+    for (i = 0; i < size; i++) {
+      if (buf[i] == '"' || buf[i] == '\\') {
+        bytes += print->write(buf + start, i - start);
+        bytes += print->write((uint8_t) '\\');
+        start = i;
+      }
+    }
+    bytes += print->write(buf + start, size - start);
+    return bytes;
+  }
+};
+
+#endif  /* M2X_STATS_H_ */
@@ -0,0 +1,166 @@
+#ifndef M2X_TIME_H_
+#define M2X_TIME_H_
+
+/*
+ * Conversions between ISO 8601 timestamps in the format M2X uses,
+ * "yyyy-mm-ddTHH:MM:SS.SSSZ", and milliseconds since the Unix epoch
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Length of "yyyy-mm-ddTHH:MM:SS.SSSZ" */
+#define M2X_ISO8601_LENGTH 24
+
+// Days since 1970-01-01 of the given date in the proleptic Gregorian calendar
+static inline int32_t m2x_days_from_civil(int32_t y, int m, int d) {
+  int32_t era, yoe, doy, doe;
+
+  y -= (m <= 2) ? 1 : 0;
+  era = ((y >= 0) ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + ((m > 2) ? -3 : 9)) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+// Inverse of m2x_days_from_civil
+static inline void m2x_civil_from_days(int32_t z, int32_t* y, int* m, int* d) {
+  int32_t era, doe, yoe, doy, mp;
+
+  z += 719468;
+  era = ((z >= 0) ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp + ((mp < 10) ? 3 : -9);
+  *y = yoe + era * 400 + ((*m <= 2) ? 1 : 0);
+}
+
+// Parses +length+ decimal digits, returns -1 if any of them isn't one
+static inline int32_t m2x_parse_digits(const char* s, int length) {
+  int32_t value = 0;
+  for (int i = 0; i < length; i++) {
+    if (s[i] < '0' || s[i] > '9') { return -1; }
+    value = value * 10 + (s[i] - '0');
+  }
+  return value;
+}
+
+static inline bool m2x_is_leap_year(int32_t y) {
+  return (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+}
+
+// Number of days in month +m+ (1 to 12) of year +y+
+static inline int m2x_days_in_month(int32_t y, int m) {
+  static const uint8_t days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  return (m == 2 && m2x_is_leap_year(y)) ? 29 : days[m - 1];
+}
+
+// Parses "yyyy-mm-ddTHH:MM:SS.SSSZ" into milliseconds since the epoch. The
+// fraction is optional and may have 1 to 3 digits. Returns false if +s+ is
+// not a timestamp in this format.
+static inline bool m2x_parse_iso8601(const char* s, int64_t* ms) {
+  int32_t year, month, day, hour, minute, second, millis = 0;
+  int i;
+
+  /* Each field is only read once the one before it and its separator
+   * matched, so a short string never gets read past its NUL */
+  if ((year = m2x_parse_digits(s, 4)) < 0 || s[4] != '-' ||
+      (month = m2x_parse_digits(s + 5, 2)) < 1 || month > 12 || s[7] != '-' ||
+      (day = m2x_parse_digits(s + 8, 2)) < 1 || day > m2x_days_in_month(year, month) ||
+      (s[10] != 'T' && s[10] != ' ') ||
+      (hour = m2x_parse_digits(s + 11, 2)) < 0 || hour > 23 || s[13] != ':' ||
+      (minute = m2x_parse_digits(s + 14, 2)) < 0 || minute > 59 || s[16] != ':' ||
+      (second = m2x_parse_digits(s + 17, 2)) < 0 || second > 60) {
+    return false;
+  }
+  s += 19;
+  if (*s == '.') {
+    s++;
+    for (i = 0; i < 3 && *s >= '0' && *s <= '9'; i++) {
+      millis = millis * 10 + (*s++ - '0');
+    }
+    if (i == 0) { return false; }
+    for (; i < 3; i++) { millis *= 10; }
+  }
+  if (*s != 'Z' || s[1] != '\0') { return false; }
+  *ms = (int64_t) m2x_days_from_civil(year, month, day) * 86400000 +
+      (int64_t) (hour * 3600 + minute * 60 + second) * 1000 + millis;
+  return true;
+}
+
+static inline void m2x_print_digits(char* buf, int32_t value, int length) {
+  while (length-- > 0) {
+    buf[length] = (char) ('0' + value % 10);
+    value /= 10;
+  }
+}
+
+// Writes +ms+ as "yyyy-mm-ddTHH:MM:SS.SSSZ" followed by a NUL, +buf+ must
+// hold at least M2X_ISO8601_LENGTH + 1 bytes. Returns the length written.
+static inline size_t m2x_format_iso8601(char* buf, int64_t ms) {
+  int64_t days = ms / 86400000;
+  int32_t millis = (int32_t) (ms % 86400000), year;
+  int month, day;
+
+  if (millis < 0) {
+    millis += 86400000;
+    days--;
+  }
+  m2x_civil_from_days((int32_t) days, &year, &month, &day);
+  m2x_print_digits(buf, year, 4);
+  buf[4] = '-';
+  m2x_print_digits(buf + 5, month, 2);
+  buf[7] = '-';
+  m2x_print_digits(buf + 8, day, 2);
+  buf[10] = 'T';
+  m2x_print_digits(buf + 11, millis / 3600000, 2);
+  buf[13] = ':';
+  m2x_print_digits(buf + 14, millis / 60000 % 60, 2);
+  buf[16] = ':';
+  m2x_print_digits(buf + 17, millis / 1000 % 60, 2);
+  buf[19] = '.';
+  m2x_print_digits(buf + 20, millis % 1000, 3);
+  buf[23] = 'Z';
+  buf[24] = '\0';
+  return M2X_ISO8601_LENGTH;
+}
+
+// Renders runs of timestamps as ISO 8601 text. Consecutive timestamps of a
+// batch usually fall within the same hour, in which case only the minutes,
+// seconds and milliseconds are rewritten and the cached date and hour are
+// kept from the previous call.
+class M2XTimestampFormatter {
+public:
+  M2XTimestampFormatter() : _hour_start(0), _valid(false) {}
+
+  // Returns the NUL terminated text of +ms+, valid until the next call
+  const char* format(int64_t ms);
+
+private:
+  char _buffer[M2X_ISO8601_LENGTH + 1];
+  int64_t _hour_start;
+  bool _valid;
+};
+
+const char* M2XTimestampFormatter::format(int64_t ms) {
+  int32_t offset;
+
+  if (_valid && ms >= _hour_start && ms - _hour_start < 3600000) {
+    offset = (int32_t) (ms - _hour_start);
+    m2x_print_digits(_buffer + 14, offset / 60000, 2);
+    m2x_print_digits(_buffer + 17, offset / 1000 % 60, 2);
+    m2x_print_digits(_buffer + 20, offset % 1000, 3);
+    return _buffer;
+  }
+  m2x_format_iso8601(_buffer, ms);
+  offset = (int32_t) (ms % 3600000);
+  if (offset < 0) { offset += 3600000; }
+  _hour_start = ms - offset;
+  _valid = true;
+  return _buffer;
+}
+
+#endif  /* M2X_TIME_H_ */
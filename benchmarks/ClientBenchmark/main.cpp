@@ -0,0 +1,240 @@
+// Benchmarks every public API call of M2XMQTTClient against the in-process
+// M2XLoopbackClient, so no network or server is involved. Build on Linux
+// with the Makefile next to this file, pointing it at minimal-mqtt and
+// minimal-json:
+//
+//   make MINIMAL_MQTT=<minimal-mqtt> MINIMAL_JSON=<minimal-json>
+//
+// Each line reports, per request: the time taken including the response,
+// the bytes the client wrote, the calls to Client::write() (TCPClient
+// coalesces them into send() calls of up to its output buffer size) and the
+// heap allocations. The last column tells whether the payload fit in the
+// M2X_PAYLOAD_BUFFER_SIZE staging buffer or had to be printed twice, once
+// to measure it and once to send it, as counted by the client's two_pass
+// statistic. Rebuild with a different M2X_PAYLOAD_BUFFER_SIZE, e.g.
+// make CPPFLAGS=-DM2X_PAYLOAD_BUFFER_SIZE=1024, to compare both paths.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "minimal-mqtt.h"
+#include "minimal-json.h"
+
+#define LINUX_PLATFORM
+#include "M2XMQTTClient.h"
+#include "m2x-loopback.h"
+
+/* Each benchmark runs for at least this long */
+#define BENCHMARK_MIN_NS 200000000LL
+
+char deviceId[] = "0123456789abcdef0123456789abcdef";
+char streamName[] = "temperature";
+char m2xKey[] = "0123456789abcdef0123456789abcdef";
+
+M2XLoopbackClient client(0);
+M2XMQTTClient m2xClient(&client, m2xKey);
+
+/* Heap allocations, counted by wrapping the glibc allocator */
+static unsigned long allocations = 0;
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+}
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+class Benchmark {
+public:
+  virtual ~Benchmark() {}
+  virtual int run() = 0;
+};
+
+// Runs +benchmark+ until BENCHMARK_MIN_NS have passed and prints its line
+static void measure(const char* name, Benchmark* benchmark) {
+  unsigned long writes, bytes, allocs, two_pass;
+  long ops = 0, batch = 1, i;
+  int64_t start, elapsed;
+  int status;
+
+  /* Warm up, connecting if needed */
+  status = benchmark->run();
+  if (!m2x_status_is_success(status)) {
+    printf("%-36s failed with status %d\n", name, status);
+    return;
+  }
+  writes = client.writes();
+  bytes = client.bytesWritten();
+  allocs = allocations;
+  two_pass = m2xClient.stats().two_pass;
+  start = now_ns();
+  do {
+    for (i = 0; i < batch; i++) { benchmark->run(); }
+    ops += batch;
+    batch *= 2;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCHMARK_MIN_NS);
+
+  bytes = client.bytesWritten() - bytes;
+  printf("%-36s %12.0f %12.1f %10.1f %8.2f  %s\n", name,
+         (double) elapsed / ops,
+         (double) bytes / ops,
+         (double) (client.writes() - writes) / ops,
+         (double) (allocations - allocs) / ops,
+         m2xClient.stats().two_pass != two_pass ? "two-pass" : "staged");
+}
+
+class UpdateStreamValue : public Benchmark {
+public:
+  int run() { return m2xClient.updateStreamValue(deviceId, streamName, 21.5); }
+};
+
+class PostDeviceUpdate : public Benchmark {
+public:
+  int run() {
+    const char* names[] = { "temperature", "humidity", "pressure" };
+    double values[] = { 21.5, 40.25, 1013.0 };
+    return m2xClient.postDeviceUpdate(deviceId, 3, names, values,
+                                      "2016-01-01T00:00:00.000Z");
+  }
+};
+
+// postDeviceUpdates with +count+ values spread over 2 streams, with
+// timestamps given as ISO 8601 text, as milliseconds or in an M2XBatch
+class PostDeviceUpdates : public Benchmark {
+public:
+  enum Mode { TEXT, MILLIS, BATCH };
+
+  PostDeviceUpdates(int count, Mode mode) : _mode(mode),
+                                             _arena_size(arenaSize(count)),
+                                             _arena(new uint8_t[_arena_size]),
+                                             _batch(_arena, _arena_size, 2) {
+    int i;
+
+    _names[0] = "temperature";
+    _names[1] = "humidity";
+    _counts[0] = count - count / 2;
+    _counts[1] = count / 2;
+    _ats = new const char*[count];
+    _millis = new int64_t[count];
+    _values = new double[count];
+    _text = new char[count * (M2X_ISO8601_LENGTH + 1)];
+    _batch.addStream(_names[0], M2X_BATCH_DOUBLE, _counts[0]);
+    _batch.addStream(_names[1], M2X_BATCH_DOUBLE, _counts[1]);
+    for (i = 0; i < count; i++) {
+      _millis[i] = 1451606400000LL + i * 1000LL;
+      _values[i] = 20 + (i % 100) * 0.25;
+      _ats[i] = _text + i * (M2X_ISO8601_LENGTH + 1);
+      m2x_format_iso8601((char*) _ats[i], _millis[i]);
+      _batch.add(i < _counts[0] ? 0 : 1, _millis[i], _values[i]);
+    }
+  }
+
+  ~PostDeviceUpdates() {
+    delete[] _ats;
+    delete[] _millis;
+    delete[] _values;
+    delete[] _text;
+    delete[] _arena;
+  }
+
+  int run() {
+    if (_mode == TEXT) {
+      return m2xClient.postDeviceUpdates(deviceId, 2, _names, _counts, _ats, _values);
+    } else if (_mode == MILLIS) {
+      return m2xClient.postDeviceUpdates(deviceId, 2, _names, _counts, _millis, _values);
+    }
+    return m2xClient.postDeviceUpdates(deviceId, _batch);
+  }
+
+private:
+  Mode _mode;
+  const char* _names[2];
+  int _counts[2];
+  const char** _ats;
+  int64_t* _millis;
+  double* _values;
+  char* _text;
+  size_t _arena_size;
+  uint8_t* _arena;
+  M2XBatch _batch;
+
+  // Stream table, names and columns, with room for alignment
+  static size_t arenaSize(int count) {
+    return 2 * sizeof(M2XBatchStream) + count * (sizeof(int64_t) + sizeof(double)) + 128;
+  }
+};
+
+class UpdateLocation : public Benchmark {
+public:
+  int run() {
+    return m2xClient.updateLocation(deviceId, "Storage Room", 28.5700, -81.3300, 25.0);
+  }
+};
+
+class DeleteValues : public Benchmark {
+public:
+  int run() {
+    return m2xClient.deleteValues(deviceId, streamName, "2016-01-01T00:00:00.000Z",
+                                  "2016-01-02T00:00:00.000Z");
+  }
+};
+
+class AsyncUpdateStreamValue : public Benchmark {
+public:
+  // Keeps M2X_MAX_PENDING_REQUESTS requests in flight
+  int run() {
+    int id = m2xClient.updateStreamValueAsync(deviceId, streamName, 21.5);
+    m2xClient.poll();
+    return id < 0 ? id : E_OK;
+  }
+};
+
+int main() {
+  static const int counts[] = { 1, 10, 100, 1000, 10000 };
+  static const char* modes[] = { "text", "millis", "batch" };
+  char name[64];
+  int i, mode;
+
+  printf("%-36s %12s %12s %10s %8s  %s\n", "benchmark", "ns/op", "bytes/op",
+         "writes/op", "allocs/op", "payload");
+
+  UpdateStreamValue updateStreamValue;
+  measure("updateStreamValue", &updateStreamValue);
+  AsyncUpdateStreamValue asyncUpdateStreamValue;
+  measure("updateStreamValueAsync", &asyncUpdateStreamValue);
+  PostDeviceUpdate postDeviceUpdate;
+  measure("postDeviceUpdate (3 streams)", &postDeviceUpdate);
+  for (mode = PostDeviceUpdates::TEXT; mode <= PostDeviceUpdates::BATCH; mode++) {
+    for (i = 0; i < (int) (sizeof(counts) / sizeof(counts[0])); i++) {
+      PostDeviceUpdates postDeviceUpdates(counts[i], (PostDeviceUpdates::Mode) mode);
+      snprintf(name, sizeof(name), "postDeviceUpdates (%d, %s)", counts[i], modes[mode]);
+      measure(name, &postDeviceUpdates);
+    }
+  }
+  UpdateLocation updateLocation;
+  measure("updateLocation", &updateLocation);
+  DeleteValues deleteValues;
+  measure("deleteValues", &deleteValues);
+  return 0;
+}
@@ -0,0 +1,45 @@
+#include "mbed.h"
+#include "EthernetInterface.h"
+
+#include "minimal-mqtt.h"
+#include "minimal-json.h"
+
+#define MBED_PLATFORM
+#include "M2XMQTTClient.h"
+
+char deviceId[] = "<device id>"; // Device you want to push to
+char streamName[] = "<stream name>"; // Stream you want to push to
+char m2xKey[] = "<m2x api key>"; // Your M2X API Key or Master API Key
+
+TCPClient<> client;
+M2XMQTTClient m2xClient(&client, m2xKey);
+
+EthernetInterface eth;
+AnalogIn sensor(p20);
+
+void onResponse(int16_t id, int status, void* context) {
+  printf("Request %d finished with status code: %d\n", id, status);
+}
+
+int main() {
+  eth.init();
+  eth.connect();
+  printf("IP Address: %s\n", eth.getIPAddress());
+
+  m2xClient.setResponseCallback(onResponse);
+
+  while (true) {
+    // Requests are sent without waiting for the previous responses, at most
+    // M2X_MAX_PENDING_REQUESTS of them are in flight at the same time.
+    int id = m2xClient.updateStreamValueAsync(deviceId, streamName, sensor.read());
+    if (id < 0) {
+      printf("Error sending request: %d\n", id);
+      if (id == E_NOCONNECTION) while (true) ;
+    }
+
+    // Deliver the responses that arrived in the meantime
+    m2xClient.poll();
+
+    delay(1000);
+  }
+}
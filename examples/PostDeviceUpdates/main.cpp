@@ -15,7 +15,7 @@ int counts[] = { 2, 1 };
 const char *ats[] = { "2013-10-11T12:34:56Z", NULL, NULL };
 double values[] = { 7.9, 11.2, 6.1 };
 
-Client client;
+TCPClient<> client;
 M2XStreamClient m2xClient(&client, m2xKey);
 
 EthernetInterface eth;
@@ -15,7 +15,7 @@ double latitude = -37.97884;
 double longitude = -57.54787; // You can also read those values from a GPS
 double elevation = 15;
 
-Client client;
+TCPClient<> client;
 M2XStreamClient m2xClient(&client, m2xKey);
 
 EthernetInterface eth;
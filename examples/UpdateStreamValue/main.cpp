@@ -12,7 +12,7 @@ char deviceId[] = "<device id>"; // Device you want to push to
 char streamName[] = "<stream name>"; // Stream you want to push to
 char m2xKey[] = "<m2x api key>"; // Your M2X API Key or Master API Key
 
-Client client;
+TCPClient<> client;
 M2XStreamClient m2xClient(&client, m2xKey);
 
 EthernetInterface eth;